@@ -49,6 +49,7 @@ Config::Config()
   this->preferred_page_size = {0, 0};
   this->use_media_box = false;
   this->bg_subsample = 3;
+  this->bg_downsample = false;
   this->fg_colors = this->FG_COLORS_DEFAULT;
   this->antialias = false;
   this->extract_metadata = true;
@@ -60,7 +61,13 @@ Config::Config()
   this->bg_slices = nullptr;
   this->page_id_template.reset(default_page_id_template("p"));
   this->page_title_template.reset(new string_format::Template("{label}"));
+  this->text_filter_persistent = false;
   this->n_jobs = 1;
+  this->render_jobs = 0;
+  this->encode_jobs = 0;
+  this->encoder_batch = 1;
+  this->spawn_helper = false;
+  this->temporary_memory = 0;
 }
 
 namespace string
@@ -248,8 +255,11 @@ void Config::read_config(int argc, char * const argv[])
     OPT_VERBOSE = 'v',
     OPT_DUMMY = CHAR_MAX,
     OPT_ANTIALIAS,
+    OPT_BG_DOWNSAMPLE,
     OPT_BG_SLICES,
     OPT_BG_SUBSAMPLE,
+    OPT_ENCODE_JOBS,
+    OPT_ENCODER_BATCH,
     OPT_FG_COLORS,
     OPT_GUESS_DPI,
     OPT_HYPERLINKS,
@@ -266,8 +276,12 @@ void Config::read_config(int argc, char * const argv[])
     OPT_PAGE_ID_TEMPLATE,
     OPT_PAGE_SIZE,
     OPT_PAGE_TITLE_TEMPLATE,
+    OPT_RENDER_JOBS,
+    OPT_SPAWN_HELPER,
+    OPT_TEMPORARY_MEMORY,
     OPT_TEXT_CROP,
     OPT_TEXT_FILTER,
+    OPT_TEXT_FILTER_PERSISTENT,
     OPT_TEXT_LINES,
     OPT_TEXT_NONE,
     OPT_TEXT_NO_NFKC,
@@ -279,10 +293,13 @@ void Config::read_config(int argc, char * const argv[])
   {
     { "anti-alias", 0, nullptr, OPT_ANTIALIAS },
     { "antialias", 0, nullptr, OPT_ANTIALIAS }, /* deprecated alias */
+    { "bg-downsample", 0, nullptr, OPT_BG_DOWNSAMPLE },
     { "bg-slices", 1, nullptr, OPT_BG_SLICES },
     { "bg-subsample", 1, nullptr, OPT_BG_SUBSAMPLE },
     { "crop-text", 0, nullptr, OPT_TEXT_CROP },
     { "dpi", 1, nullptr, OPT_DPI },
+    { "encode-jobs", 1, nullptr, OPT_ENCODE_JOBS },
+    { "encoder-batch", 1, nullptr, OPT_ENCODER_BATCH },
     { "fg-colors", 1, nullptr, OPT_FG_COLORS },
     { "filter-text", 1, nullptr, OPT_TEXT_FILTER },
     { "guess-dpi", 0, nullptr, OPT_GUESS_DPI },
@@ -311,7 +328,11 @@ void Config::read_config(int argc, char * const argv[])
     { "pageid-prefix", 1, nullptr, OPT_PAGE_ID_PREFIX }, /* deprecated alias */
     { "pageid-template", 1, nullptr, OPT_PAGE_ID_TEMPLATE }, /* deprecated alias */
     { "pages", 1, nullptr, OPT_PAGES },
+    { "persistent-filter-text", 1, nullptr, OPT_TEXT_FILTER_PERSISTENT },
     { "quiet", 0, nullptr, OPT_QUIET },
+    { "render-jobs", 1, nullptr, OPT_RENDER_JOBS },
+    { "spawn-helper", 0, nullptr, OPT_SPAWN_HELPER },
+    { "temporary-memory", 1, nullptr, OPT_TEMPORARY_MEMORY },
     { "verbatim-metadata", 0, nullptr, OPT_VERBATIM_METADATA },
     { "verbose", 0, nullptr, OPT_VERBOSE },
     { "version", 0, nullptr, OPT_VERSION },
@@ -356,6 +377,9 @@ void Config::read_config(int argc, char * const argv[])
     case OPT_BG_SUBSAMPLE:
       this->bg_subsample = parse_bg_subsample(optarg);
       break;
+    case OPT_BG_DOWNSAMPLE:
+      this->bg_downsample = true;
+      break;
     case OPT_FG_COLORS:
       this->fg_colors = parse_fg_colors(optarg);
       break;
@@ -410,8 +434,10 @@ void Config::read_config(int argc, char * const argv[])
       this->text_nfkc = false;
       break;
     case OPT_TEXT_FILTER:
+    case OPT_TEXT_FILTER_PERSISTENT:
       this->text_nfkc = false; /* filter normally does some normalization on its own */
       this->text_filter_command_line = optarg;
+      this->text_filter_persistent = (c == OPT_TEXT_FILTER_PERSISTENT);
       break;
     case OPT_TEXT_CROP:
       this->text_crop = true;
@@ -431,8 +457,8 @@ void Config::read_config(int argc, char * const argv[])
         split_path(this->output, directory_name, file_name);
         if (file_name == "-")
         {
-          /* ``djvmcvt`` does not support ``-`` as a file name.
-           * Work-arounds are possible but not worthwhile.
+          /* A file named ``-`` would be too easily confused with standard
+           * output.
            */
           throw Config::Error(_("Invalid output file name"));
         }
@@ -487,6 +513,29 @@ void Config::read_config(int argc, char * const argv[])
     case OPT_JOBS:
       this->n_jobs = string::as<int>(optarg);
       break;
+    case OPT_RENDER_JOBS:
+      this->render_jobs = string::as<int>(optarg);
+      if (this->render_jobs < 0)
+        throw Config::Error(_("The specified number of rendering threads must not be negative"));
+      break;
+    case OPT_ENCODE_JOBS:
+      this->encode_jobs = string::as<int>(optarg);
+      if (this->encode_jobs < 0)
+        throw Config::Error(_("The specified number of encoding threads must not be negative"));
+      break;
+    case OPT_ENCODER_BATCH:
+      this->encoder_batch = string::as<int>(optarg);
+      if (this->encoder_batch < 1)
+        throw Config::Error(_("The specified number of pages per encoder run must be positive"));
+      break;
+    case OPT_SPAWN_HELPER:
+      this->spawn_helper = true;
+      break;
+    case OPT_TEMPORARY_MEMORY:
+      this->temporary_memory = string::as<int>(optarg);
+      if (this->temporary_memory < 0)
+        throw Config::Error(_("The specified amount of memory for temporary files must not be negative"));
+      break;
     case OPT_HELP:
       throw NeedHelp();
     case OPT_VERSION:
@@ -536,6 +585,7 @@ static void print_usage(streamtp &stream)
     << std::endl <<   "     --bg-slices=N,...,N"
     << std::endl <<   "     --bg-slices=N+...+N"
     << std::endl <<   "     --bg-subsample=N"
+    << std::endl <<   "     --bg-downsample"
     << std::endl <<   "     --fg-colors=default"
     << std::endl <<   "     --fg-colors=web"
     << std::endl <<   "     --fg-colors=black"
@@ -558,11 +608,15 @@ static void print_usage(streamtp &stream)
     << std::endl <<   "     --crop-text"
     << std::endl <<   "     --no-nfkc"
     << std::endl << _("     --filter-text=COMMAND-LINE")
+    << std::endl << _("     --persistent-filter-text=COMMAND-LINE")
     << std::endl <<   " -p, --pages=..."
     << std::endl <<   " -v, --verbose"
-#if _OPENMP
     << std::endl <<   " -j, --jobs=N"
-#endif
+    << std::endl <<   "     --render-jobs=N"
+    << std::endl <<   "     --encode-jobs=N"
+    << std::endl <<   "     --encoder-batch=N"
+    << std::endl <<   "     --spawn-helper"
+    << std::endl <<   "     --temporary-memory=N"
     << std::endl <<   " -q, --quiet"
     << std::endl <<   " -h, --help"
     << std::endl <<   "     --version"
@@ -71,6 +71,7 @@ public:
   std::pair<int, int> preferred_page_size;
   bool use_media_box;
   int bg_subsample;
+  bool bg_downsample;
   int fg_colors;
   bool monochrome;
   int loss_level;
@@ -86,7 +87,13 @@ public:
   std::unique_ptr<string_format::Template> page_id_template;
   std::unique_ptr<string_format::Template> page_title_template;
   std::string text_filter_command_line;
+  bool text_filter_persistent;
   int n_jobs;
+  int render_jobs;
+  int encode_jobs;
+  int encoder_batch;
+  bool spawn_helper;
+  int temporary_memory;
 
   Config();
 
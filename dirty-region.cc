@@ -0,0 +1,72 @@
+/* Copyright © 2026 agent <agent@local>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "dirty-region.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+void DirtyRegion::reset(int width, int height)
+{
+  this->width = width;
+  this->height = height;
+  this->everything = false;
+  this->rows.assign(height, std::vector<std::pair<int, int>>());
+}
+
+static int clamp(double x, int max)
+{
+  if (!(x > 0)) /* also catches NaN */
+    return 0;
+  if (x > max)
+    return max;
+  return static_cast<int>(x);
+}
+
+void DirtyRegion::add(double x0, double y0, double x1, double y1, double margin)
+/* Add the rectangle, enlarged by the margin to account for anti-aliasing
+ * and rounding, and clipped to the image.
+ */
+{
+  if (this->everything)
+    return;
+  if (x0 > x1)
+    std::swap(x0, x1);
+  if (y0 > y1)
+    std::swap(y0, y1);
+  int ix0 = clamp(std::floor(x0 - margin), this->width);
+  int iy0 = clamp(std::floor(y0 - margin), this->height);
+  int ix1 = clamp(std::ceil(x1 + margin), this->width);
+  int iy1 = clamp(std::ceil(y1 + margin), this->height);
+  if (ix0 >= ix1)
+    return;
+  for (int y = iy0; y < iy1; y++)
+    this->rows[y].push_back(std::make_pair(ix0, ix1));
+}
+
+void DirtyRegion::get_row_mask(int y, std::vector<uint8_t> &mask) const
+/* Set mask[x] to 1 for pixels of the row that belong to the region,
+ * and to 0 for the others. The mask must be as wide as the image.
+ */
+{
+  std::fill(mask.begin(), mask.end(), this->everything);
+  if (this->everything)
+    return;
+  assert(mask.size() == static_cast<size_t>(this->width));
+  for (const std::pair<int, int> &span : this->rows[y])
+    std::fill(mask.begin() + span.first, mask.begin() + span.second, 1);
+}
+
+// vim:ts=2 sts=2 sw=2 et
@@ -0,0 +1,51 @@
+/* Copyright © 2026 agent <agent@local>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PDF2DJVU_DIRTY_REGION_H
+#define PDF2DJVU_DIRTY_REGION_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/* Union of rectangles (in device coordinates) where the foreground and the
+ * background images may differ. Pixels outside of it are known to be
+ * identical in both images.
+ */
+class DirtyRegion
+{
+protected:
+  int width, height;
+  bool everything;
+  std::vector<std::vector<std::pair<int, int>>> rows;
+public:
+  DirtyRegion()
+  : width(0), height(0), everything(true)
+  { }
+  void reset(int width, int height);
+  void add(double x0, double y0, double x1, double y1, double margin = 2.0);
+  void add_all()
+  {
+    this->everything = true;
+  }
+  bool is_everything() const
+  {
+    return this->everything;
+  }
+  void get_row_mask(int y, std::vector<uint8_t> &mask) const;
+};
+
+#endif
+
+// vim:ts=2 sts=2 sw=2 et
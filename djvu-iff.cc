@@ -0,0 +1,225 @@
+/* Copyright © 2026 agent <agent@local>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "djvu-iff.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include "i18n.hh"
+
+djvu::IFFError::IFFError()
+: std::runtime_error(_("Malformed DjVu file"))
+{ }
+
+static void print_int32(std::ostream &stream, size_t value)
+{
+    if (static_cast<uint64_t>(value) > 0xFFFFFFFFU)
+        throw djvu::IFFError();
+    for (int i = 3; i >= 0; i--)
+        stream << static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+static void read_exactly(std::istream &stream, char *buffer, size_t size)
+{
+    stream.read(buffer, size);
+    if (static_cast<size_t>(stream.gcount()) != size)
+        throw djvu::IFFError();
+}
+
+static size_t read_int32(std::istream &stream)
+{
+    unsigned char buffer[4];
+    read_exactly(stream, reinterpret_cast<char*>(buffer), sizeof buffer);
+    size_t value = 0;
+    for (unsigned char c : buffer)
+        value = (value << 8) | c;
+    return value;
+}
+
+size_t djvu::Chunk::size() const
+{
+    size_t size = this->data.size();
+    return 8 + size + (size & 1);
+}
+
+const djvu::Chunk *djvu::Form::find(const std::string &id) const
+{
+    for (const djvu::Chunk &chunk : this->chunks)
+        if (chunk.id == id)
+            return &chunk;
+    return nullptr;
+}
+
+void djvu::Form::append(const djvu::Chunk &chunk)
+{
+    assert(chunk.id.size() == 4);
+    this->chunks.push_back(chunk);
+}
+
+void djvu::Form::insert_before(const std::string &id, const djvu::Chunk &chunk)
+/* Insert the chunk before the first chunk with the given identifier.
+ * If there is no such chunk, append it at the end.
+ */
+{
+    assert(chunk.id.size() == 4);
+    std::vector<djvu::Chunk>::iterator it = std::find_if(
+        this->chunks.begin(), this->chunks.end(),
+        [&id](const djvu::Chunk &other) { return other.id == id; }
+    );
+    this->chunks.insert(it, chunk);
+}
+
+void djvu::Form::insert_after(const std::string &id, const djvu::Chunk &chunk)
+/* Insert the chunk after the first chunk with the given identifier.
+ * If there is no such chunk, insert it at the beginning.
+ */
+{
+    assert(chunk.id.size() == 4);
+    std::vector<djvu::Chunk>::iterator it = std::find_if(
+        this->chunks.begin(), this->chunks.end(),
+        [&id](const djvu::Chunk &other) { return other.id == id; }
+    );
+    if (it == this->chunks.end())
+        it = this->chunks.begin();
+    else
+        it++;
+    this->chunks.insert(it, chunk);
+}
+
+void djvu::Form::replace(const djvu::Chunk &chunk)
+/* Replace the first chunk with the same identifier, and remove the other ones.
+ * If there is no such chunk, append it at the end.
+ */
+{
+    bool replaced = false;
+    std::vector<djvu::Chunk> new_chunks;
+    new_chunks.reserve(this->chunks.size() + 1);
+    for (djvu::Chunk &other : this->chunks)
+    {
+        if (other.id != chunk.id)
+            new_chunks.push_back(std::move(other));
+        else if (!replaced)
+        {
+            new_chunks.push_back(chunk);
+            replaced = true;
+        }
+    }
+    if (!replaced)
+        new_chunks.push_back(chunk);
+    this->chunks.swap(new_chunks);
+}
+
+void djvu::Form::remove(const std::string &id)
+{
+    this->chunks.erase(
+        std::remove_if(
+            this->chunks.begin(), this->chunks.end(),
+            [&id](const djvu::Chunk &chunk) { return chunk.id == id; }
+        ),
+        this->chunks.end()
+    );
+}
+
+std::vector<djvu::Form> djvu::Form::get_forms(const std::string &type) const
+/* Parse nested FORM chunks of the given type, such as components of a
+ * bundled document.
+ */
+{
+    std::vector<djvu::Form> forms;
+    for (const djvu::Chunk &chunk : this->chunks)
+    {
+        if (chunk.id != "FORM" || chunk.data.compare(0, 4, type) != 0)
+            continue;
+        std::ostringstream header;
+        header << chunk.id;
+        print_int32(header, chunk.data.size());
+        std::istringstream stream(header.str() + chunk.data);
+        forms.push_back(djvu::Form());
+        stream >> forms.back();
+    }
+    return forms;
+}
+
+size_t djvu::Form::size() const
+/* Return size of the FORM chunk data, as stored in the chunk header.
+ * The whole file is 12 bytes larger than that.
+ */
+{
+    size_t size = 4;
+    for (const djvu::Chunk &chunk : this->chunks)
+        size += chunk.size();
+    return size;
+}
+
+std::istream& djvu::operator>>(std::istream &stream, djvu::Form &form)
+{
+    char id[4];
+    read_exactly(stream, id, sizeof id);
+    if (std::memcmp(id, "AT&T", 4) == 0)
+        read_exactly(stream, id, sizeof id);
+    if (std::memcmp(id, "FORM", 4) != 0)
+        throw djvu::IFFError();
+    size_t size = read_int32(stream);
+    if (size < 4)
+        throw djvu::IFFError();
+    read_exactly(stream, id, sizeof id);
+    form.type.assign(id, sizeof id);
+    form.chunks.clear();
+    size -= 4;
+    while (size > 0)
+    {
+        if (size < 8)
+            throw djvu::IFFError();
+        read_exactly(stream, id, sizeof id);
+        size_t chunk_size = read_int32(stream);
+        size -= 8;
+        if (chunk_size > size)
+            throw djvu::IFFError();
+        std::string data(chunk_size, '\0');
+        if (chunk_size > 0)
+            read_exactly(stream, &data[0], chunk_size);
+        size -= chunk_size;
+        if ((chunk_size & 1) && size > 0)
+        {
+            stream.ignore(1);
+            size--;
+        }
+        form.chunks.push_back(djvu::Chunk(std::string(id, sizeof id), data));
+    }
+    return stream;
+}
+
+std::ostream& djvu::operator<<(std::ostream &stream, const djvu::Form &form)
+{
+    stream.write("AT&TFORM", 8);
+    print_int32(stream, form.size());
+    stream << form.type;
+    for (const djvu::Chunk &chunk : form.chunks)
+    {
+        stream << chunk.id;
+        print_int32(stream, chunk.data.size());
+        stream << chunk.data;
+        if (chunk.data.size() & 1)
+            stream << '\0';
+    }
+    return stream;
+}
+
+// vim:ts=4 sts=4 sw=4 et
@@ -0,0 +1,93 @@
+/* Copyright © 2026 agent <agent@local>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PDF2DJVU_DJVU_IFF_H
+#define PDF2DJVU_DJVU_IFF_H
+
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace djvu
+{
+
+    class IFFError
+    : public std::runtime_error
+    {
+    public:
+        IFFError();
+    };
+
+    class Chunk
+    {
+    public:
+        std::string id;
+        std::string data;
+        Chunk(const std::string &id, const std::string &data)
+        : id(id),
+          data(data)
+        { }
+        size_t size() const;
+    };
+
+    /* In-memory representation of a DjVu IFF file, i.e. a single FORM chunk.
+     *
+     * Nested FORM chunks are not parsed; they are kept as opaque chunks with
+     * the "FORM" identifier, with the secondary identifier as the first four
+     * bytes of the data.
+     */
+    class Form
+    {
+    private:
+        std::string type;
+        std::vector<Chunk> chunks;
+    public:
+        explicit Form(const std::string &type = "DJVU")
+        : type(type)
+        { }
+        const std::string &get_type() const
+        {
+            return this->type;
+        }
+        const std::vector<Chunk> &get_chunks() const
+        {
+            return this->chunks;
+        }
+        const Chunk *find(const std::string &id) const;
+        void append(const Chunk &chunk);
+        void append(const std::string &id, const std::string &data)
+        {
+            this->append(Chunk(id, data));
+        }
+        void insert_before(const std::string &id, const Chunk &chunk);
+        void insert_after(const std::string &id, const Chunk &chunk);
+        void replace(const Chunk &chunk);
+        void remove(const std::string &id);
+        std::vector<Form> get_forms(const std::string &type) const;
+        size_t size() const;
+        friend std::istream &operator>>(std::istream &, Form &);
+        friend std::ostream &operator<<(std::ostream &, const Form &);
+    };
+
+    std::istream &operator>>(std::istream &, Form &);
+    std::ostream &operator<<(std::ostream &, const Form &);
+
+}
+
+#endif
+
+// vim:ts=4 sts=4 sw=4 et
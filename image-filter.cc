@@ -14,12 +14,12 @@
 
 #include "image-filter.hh"
 
-#include <bitset>
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
-#include <map>
 #include <ostream>
+#include <string>
 #include <vector>
 
 #include "autoconf.hh"
@@ -28,12 +28,181 @@
 #include "pdf-backend.hh"
 #include "rle.hh"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define X86_SIMD 1
+#include <immintrin.h>
+#else
+#define X86_SIMD 0
+#endif
+
 #if HAVE_GRAPHICSMAGICK
 #include <Magick++.h>
 #endif
 
 static void dummy_quantizer(int width, int height, int *background_color, std::ostream &stream);
 
+/* Foreground/background separation
+ * =================================
+ *
+ * separate_row() processes one row of both images. On input, mask[x] tells
+ * whether the pixel is in the dirty region; on output, it tells whether the
+ * pixel belongs to the foreground, i.e. whether it differs between the
+ * images. has_background is set if any background pixel differs from
+ * background_color; has_foreground is set if any foreground pixel is not
+ * black.
+ *
+ * The vectorized variants compare blocks of 16 or 32 pixels at once, and
+ * fall back to the scalar code only for blocks that actually differ, which
+ * are rare on typical pages.
+ */
+
+typedef void separate_row_fn(const uint8_t *fg, const uint8_t *bg, uint8_t *mask, int width,
+  const uint8_t *background_color, bool &has_foreground, bool &has_background);
+
+static inline void separate_pixels(const uint8_t *fg, const uint8_t *bg, uint8_t *mask, int width,
+  const uint8_t *background_color, bool &has_foreground, bool &has_background)
+{
+  for (int x = 0; x < width; x++, fg += 3, bg += 3)
+  {
+    if (!has_background)
+      if (bg[0] != background_color[0] || bg[1] != background_color[1] || bg[2] != background_color[2])
+        has_background = true;
+    if (mask[x] && (fg[0] != bg[0] || fg[1] != bg[1] || fg[2] != bg[2]))
+    {
+      if (!has_foreground && (fg[0] || fg[1] || fg[2]))
+        has_foreground = true;
+      mask[x] = 1;
+    }
+    else
+      mask[x] = 0;
+  }
+}
+
+static void separate_row_scalar(const uint8_t *fg, const uint8_t *bg, uint8_t *mask, int width,
+  const uint8_t *background_color, bool &has_foreground, bool &has_background)
+{
+  separate_pixels(fg, bg, mask, width, background_color, has_foreground, has_background);
+}
+
+#if X86_SIMD
+
+__attribute__((target("sse2")))
+static void separate_row_sse2(const uint8_t *fg, const uint8_t *bg, uint8_t *mask, int width,
+  const uint8_t *background_color, bool &has_foreground, bool &has_background)
+{
+  uint8_t pattern_bytes[48];
+  for (int i = 0; i < 48; i++)
+    pattern_bytes[i] = background_color[i % 3];
+  const __m128i *pattern = reinterpret_cast<const __m128i*>(pattern_bytes);
+  const __m128i pattern0 = _mm_loadu_si128(pattern);
+  const __m128i pattern1 = _mm_loadu_si128(pattern + 1);
+  const __m128i pattern2 = _mm_loadu_si128(pattern + 2);
+  const __m128i zero = _mm_setzero_si128();
+  int x = 0;
+  for (; x + 16 <= width; x += 16, fg += 48, bg += 48, mask += 16)
+  {
+    const __m128i *bg_block = reinterpret_cast<const __m128i*>(bg);
+    const __m128i bg0 = _mm_loadu_si128(bg_block);
+    const __m128i bg1 = _mm_loadu_si128(bg_block + 1);
+    const __m128i bg2 = _mm_loadu_si128(bg_block + 2);
+    if (!has_background)
+    {
+      __m128i eq = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(bg0, pattern0), _mm_cmpeq_epi8(bg1, pattern1)),
+        _mm_cmpeq_epi8(bg2, pattern2)
+      );
+      if (_mm_movemask_epi8(eq) != 0xFFFF)
+        has_background = true;
+    }
+    __m128i *mask_block = reinterpret_cast<__m128i*>(mask);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(mask_block), zero)) == 0xFFFF)
+      continue; /* outside the dirty region */
+    const __m128i *fg_block = reinterpret_cast<const __m128i*>(fg);
+    __m128i eq = _mm_and_si128(
+      _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(fg_block), bg0), _mm_cmpeq_epi8(_mm_loadu_si128(fg_block + 1), bg1)),
+      _mm_cmpeq_epi8(_mm_loadu_si128(fg_block + 2), bg2)
+    );
+    if (_mm_movemask_epi8(eq) == 0xFFFF)
+      _mm_storeu_si128(mask_block, zero);
+    else
+      separate_pixels(fg, bg, mask, 16, background_color, has_foreground, has_background);
+  }
+  separate_pixels(fg, bg, mask, width - x, background_color, has_foreground, has_background);
+}
+
+__attribute__((target("avx2")))
+static void separate_row_avx2(const uint8_t *fg, const uint8_t *bg, uint8_t *mask, int width,
+  const uint8_t *background_color, bool &has_foreground, bool &has_background)
+{
+  uint8_t pattern_bytes[96];
+  for (int i = 0; i < 96; i++)
+    pattern_bytes[i] = background_color[i % 3];
+  const __m256i *pattern = reinterpret_cast<const __m256i*>(pattern_bytes);
+  const __m256i pattern0 = _mm256_loadu_si256(pattern);
+  const __m256i pattern1 = _mm256_loadu_si256(pattern + 1);
+  const __m256i pattern2 = _mm256_loadu_si256(pattern + 2);
+  const __m256i zero = _mm256_setzero_si256();
+  int x = 0;
+  for (; x + 32 <= width; x += 32, fg += 96, bg += 96, mask += 32)
+  {
+    const __m256i *bg_block = reinterpret_cast<const __m256i*>(bg);
+    const __m256i bg0 = _mm256_loadu_si256(bg_block);
+    const __m256i bg1 = _mm256_loadu_si256(bg_block + 1);
+    const __m256i bg2 = _mm256_loadu_si256(bg_block + 2);
+    if (!has_background)
+    {
+      __m256i eq = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi8(bg0, pattern0), _mm256_cmpeq_epi8(bg1, pattern1)),
+        _mm256_cmpeq_epi8(bg2, pattern2)
+      );
+      if (_mm256_movemask_epi8(eq) != -1)
+        has_background = true;
+    }
+    __m256i *mask_block = reinterpret_cast<__m256i*>(mask);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(mask_block), zero)) == -1)
+      continue; /* outside the dirty region */
+    const __m256i *fg_block = reinterpret_cast<const __m256i*>(fg);
+    __m256i eq = _mm256_and_si256(
+      _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(fg_block), bg0), _mm256_cmpeq_epi8(_mm256_loadu_si256(fg_block + 1), bg1)),
+      _mm256_cmpeq_epi8(_mm256_loadu_si256(fg_block + 2), bg2)
+    );
+    if (_mm256_movemask_epi8(eq) == -1)
+      _mm256_storeu_si256(mask_block, zero);
+    else
+      separate_pixels(fg, bg, mask, 32, background_color, has_foreground, has_background);
+  }
+  separate_pixels(fg, bg, mask, width - x, background_color, has_foreground, has_background);
+}
+
+#endif
+
+static separate_row_fn *select_separate_row()
+{
+#if X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return separate_row_avx2;
+  if (__builtin_cpu_supports("sse2"))
+    return separate_row_sse2;
+#endif
+  return separate_row_scalar;
+}
+
+static void separate_row(const uint8_t *fg, const uint8_t *bg, uint8_t *mask, int width,
+  const int *background_color, bool &has_foreground, bool &has_background)
+{
+  static separate_row_fn * const implementation = select_separate_row();
+  uint8_t background_bytes[3];
+  for (int i = 0; i < 3; i++)
+  {
+    if (background_color[i] < 0 || background_color[i] > 0xFF)
+      /* No pixel can match such color. */
+      has_background = true;
+    background_bytes[i] = background_color[i];
+  }
+  implementation(fg, bg, mask, width, background_bytes, has_foreground, has_background);
+}
+
 void WebSafeQuantizer::output_web_palette(std::ostream &stream)
 {
   stream << "216" << std::endl;
@@ -59,7 +228,7 @@ static inline void write_uint32(std::ostream &stream, uint32_t item)
 }
 
 void MaskQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+  const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
 {
   if (out_fg == out_bg)
   { /* Don't bother to analyze images if they are obviously identical. */
@@ -70,40 +239,21 @@ void MaskQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int
   rle::R4 r4(stream, width, height);
   pdf::Pixmap bmp_fg(out_fg);
   pdf::Pixmap bmp_bg(out_bg);
-  pdf::Pixmap::iterator p_fg = bmp_fg.begin();
-  pdf::Pixmap::iterator p_bg = bmp_bg.begin();
+  /* Pixels outside the dirty region are known to be the same in both images: */
+  std::vector<uint8_t> mask(width);
   for (int y = 0; y < height; y++)
   {
+    dirty_region.get_row_mask(y, mask);
+    separate_row(bmp_fg.get_row(y), bmp_bg.get_row(y), mask.data(), width,
+      background_color, has_foreground, has_background);
     for (int x = 0; x < width; x++)
-    {
-      if (!has_background)
-      {
-        for (int i = 0; i < 3; i++)
-        if (background_color[i] != p_bg[i])
-        {
-          has_background = true;
-          break;
-        }
-      }
-      if (p_fg[0] != p_bg[0] || p_fg[1] != p_bg[1] || p_fg[2] != p_bg[2])
-      {
-        if (!has_foreground && (p_fg[0] || p_fg[1] || p_fg[2]))
-          has_foreground = true;
-        r4 << 1;
-      }
-      else
-        r4 << 0;
-      p_fg++;
-      p_bg++;
-    }
-    p_fg.next_row();
-    p_bg.next_row();
+      r4 << mask[x];
   }
 
 }
 
 void WebSafeQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+  const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
 {
   if (out_fg == out_bg)
   { /* Don't bother to analyze images if they are obviously identical. */
@@ -115,31 +265,21 @@ void WebSafeQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg,
   output_web_palette(stream);
   pdf::Pixmap bmp_fg(out_fg);
   pdf::Pixmap bmp_bg(out_bg);
-  pdf::Pixmap::iterator p_fg = bmp_fg.begin();
-  pdf::Pixmap::iterator p_bg = bmp_bg.begin();
+  std::vector<uint8_t> mask(width);
   for (int i = 0; i < 3; i++)
-    background_color[i] = p_bg[i];
+    background_color[i] = bmp_bg.get_row(0)[i];
   for (int y = 0; y < height; y++)
   {
+    dirty_region.get_row_mask(y, mask);
+    const uint8_t *p_fg = bmp_fg.get_row(y);
+    separate_row(p_fg, bmp_bg.get_row(y), mask.data(), width,
+      background_color, has_foreground, has_background);
     int new_color, color = 0xFFF;
     int length = 0;
-    for (int x = 0; x < width; x++)
+    for (int x = 0; x < width; x++, p_fg += 3)
     {
-      if (!has_background)
-      {
-        for (int i = 0; i < 3; i++)
-        if (background_color[i] != p_bg[i])
-        {
-          has_background = true;
-          break;
-        }
-      }
-      if (p_fg[0] != p_bg[0] || p_fg[1] != p_bg[1] || p_fg[2] != p_bg[2])
-      {
-        if (!has_foreground && (p_fg[0] || p_fg[1] || p_fg[2]))
-          has_foreground = true;
+      if (mask[x])
         new_color = ((p_fg[2] + 1) / 43) + 6 * (((p_fg[1] + 1) / 43) + 6 * ((p_fg[0] + 1) / 43));
-      }
       else
         new_color = 0xFFF;
       if (color == new_color)
@@ -151,11 +291,7 @@ void WebSafeQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg,
         color = new_color;
         length = 1;
       }
-      p_fg++;
-      p_bg++;
     }
-    p_fg.next_row();
-    p_bg.next_row();
     write_uint32(stream, (static_cast<uint32_t>(color) << 20) + length);
   }
 }
@@ -218,7 +354,7 @@ class Run
 {
 protected:
   Rgb18 color;
-  size_t length;
+  uint32_t length;
 public:
   explicit Run(Rgb18 color)
   : color(color), length(0)
@@ -238,14 +374,14 @@ public:
   {
     return this->color;
   }
-  size_t get_length() const
+  uint32_t get_length() const
   {
     return this->length;
   }
 };
 
 void DefaultQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+  const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
 {
   if (out_fg == out_bg)
   { /* Don't bother to analyze images if they are obviously identical. */
@@ -256,38 +392,32 @@ void DefaultQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg,
   stream << "R6 " << width << " " << height << " ";
   pdf::Pixmap bmp_fg(out_fg);
   pdf::Pixmap bmp_bg(out_bg);
-  pdf::Pixmap::iterator p_fg = bmp_fg.begin();
-  pdf::Pixmap::iterator p_bg = bmp_bg.begin();
-  size_t color_counter = 0;
-  std::bitset<1 << 18> original_colors;
-  std::bitset<1 << 18> quantized_colors;
-  std::vector<std::vector<Run>> runs(height);
+  std::vector<uint8_t> mask(width);
+  /* Marks of the colors that were already seen; later reused to map colors
+   * into color indices: */
+  std::vector<uint32_t> color_table(1 << 18);
+  std::vector<int> original_colors;
+  /* Runs of all the rows, one after another: */
+  std::vector<Run> runs;
   for (int i = 0; i < 3; i++)
-    background_color[i] = p_bg[i];
+    background_color[i] = bmp_bg.get_row(0)[i];
   for (int y = 0; y < height; y++)
   {
+    dirty_region.get_row_mask(y, mask);
+    const uint8_t *p_fg = bmp_fg.get_row(y);
+    separate_row(p_fg, bmp_bg.get_row(y), mask.data(), width,
+      background_color, has_foreground, has_background);
     Run run;
     Rgb18 new_color;
-    for (int x = 0; x < width; x++)
+    for (int x = 0; x < width; x++, p_fg += 3)
     {
-      if (!has_background)
-      {
-        for (int i = 0; i < 3; i++)
-        if (background_color[i] != p_bg[i])
-        {
-          has_background = true;
-          break;
-        }
-      }
-      if (p_fg[0] != p_bg[0] || p_fg[1] != p_bg[1] || p_fg[2] != p_bg[2])
+      if (mask[x])
       {
-        if (!has_foreground && (p_fg[0] || p_fg[1] || p_fg[2]))
-          has_foreground = true;
         new_color = Rgb18(p_fg[0], p_fg[1], p_fg[2]);
-        if (!original_colors[new_color])
+        if (color_table[new_color] == 0)
         {
-          color_counter++;
-          original_colors.set(new_color);
+          color_table[new_color] = 1;
+          original_colors.push_back(new_color);
         }
       }
       else
@@ -297,98 +427,82 @@ void DefaultQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg,
       else
       {
         if (run.get_length() > 0)
-          runs[y].push_back(run);
+          runs.push_back(run);
         run = Run(new_color);
         run++;
       }
-      p_fg++;
-      p_bg++;
     }
-    p_fg.next_row();
-    p_bg.next_row();
     if (run.get_length() > 0)
-      runs[y].push_back(run);
+      runs.push_back(run);
   }
-  /* Find appropriate color palette: */
+  /* Find appropriate color palette.
+   * Only the colors that actually occur need to be considered. The colors
+   * that were already seen with the current divisor are marked in
+   * color_table with the divisor itself: */
   int divisor = 4;
-  while (color_counter > djvu::max_fg_colors)
+  std::vector<int> quantized_colors;
+  if (original_colors.size() > djvu::max_fg_colors)
   {
-    size_t new_color_counter = 0;
-    quantized_colors.reset();
-    divisor++;
-    for (size_t color = 0; color < original_colors.size(); color++)
+    quantized_colors.reserve(djvu::max_fg_colors + 1);
+    do
     {
-      if (!original_colors[color])
-        continue;
-      Rgb18 new_color = Rgb18(color).reduce(divisor);
-      if (!quantized_colors[new_color])
+      divisor++;
+      quantized_colors.clear();
+      for (int color : original_colors)
       {
-        quantized_colors.set(new_color);
-        new_color_counter++;
-        if (new_color_counter > djvu::max_fg_colors)
+        int new_color = Rgb18(static_cast<size_t>(color)).reduce(divisor);
+        if (color_table[new_color] == static_cast<uint32_t>(divisor))
+          continue;
+        color_table[new_color] = divisor;
+        quantized_colors.push_back(new_color);
+        if (quantized_colors.size() > djvu::max_fg_colors)
           break;
       }
     }
-    color_counter = new_color_counter;
+    while (quantized_colors.size() > djvu::max_fg_colors);
   }
-  if (divisor == 4)
+  else
     quantized_colors = original_colors;
+  std::sort(quantized_colors.begin(), quantized_colors.end());
   /* Output the palette: */
-  if (color_counter == 0)
+  if (quantized_colors.empty())
   {
     stream << 1 << std::endl << "\xFF\xFF\xFF";
   }
   else
   {
-    stream << color_counter << std::endl;
-    for (size_t color = 0; color < quantized_colors.size(); color++)
+    stream << quantized_colors.size() << std::endl;
+    for (int color : quantized_colors)
     {
-      if (quantized_colors[color])
-      {
-        Rgb18 rgb18(color);
-        unsigned char buffer[3];
-        for (int i = 0; i < 3; i++)
-          buffer[i] = rgb18[i];
-        stream.write(reinterpret_cast<char*>(buffer), 3);
-      }
+      Rgb18 rgb18(static_cast<size_t>(color));
+      unsigned char buffer[3];
+      for (int i = 0; i < 3; i++)
+        buffer[i] = rgb18[i];
+      stream.write(reinterpret_cast<char*>(buffer), 3);
     }
   }
   /* Map colors into color indices: */
-  std::map<int, uint32_t> color_map;
-  uint32_t last_color_index = 0;
-  color_map[-1] = 0xFFF;
   if (divisor == 4)
-    for (size_t color = 0; color < original_colors.size(); color++)
-    {
-      if (!original_colors[color])
-        continue;
-      color_map[color] = last_color_index++;
-    }
+    for (size_t i = 0; i < quantized_colors.size(); i++)
+      color_table[quantized_colors[i]] = i;
   else
-  {
-    std::map<int, uint32_t> quantized_color_map;
-    for (size_t color = 0; color < quantized_colors.size(); color++)
-    {
-      if (!quantized_colors[color])
-        continue;
-      quantized_color_map[color] = last_color_index++;
-    }
-    for (size_t color = 0; color < original_colors.size(); color++)
+    for (int color : original_colors)
     {
-      Rgb18 new_color = Rgb18(color).reduce(divisor);
-      color_map[color] = quantized_color_map[new_color];
+      int new_color = Rgb18(static_cast<size_t>(color)).reduce(divisor);
+      color_table[color] = std::lower_bound(quantized_colors.begin(), quantized_colors.end(), new_color) - quantized_colors.begin();
     }
-  }
   /* Output runs: */
-  for (int y = 0; y < height; y++)
+  std::string data;
+  data.reserve(4 * runs.size());
+  for (const Run &run : runs)
   {
-    const std::vector<Run> line_runs = runs[y];
-    for (const Run &run : line_runs)
-    {
-      uint32_t color_index = color_map[run.get_color()];
-      write_uint32(stream, (static_cast<uint32_t>(color_index) << 20) + run.get_length());
-    }
+    int color = run.get_color();
+    uint32_t color_index = color < 0 ? 0xFFF : color_table[color];
+    uint32_t item = (color_index << 20) + run.get_length();
+    for (int i = 0; i < 4; i++)
+      data += static_cast<char>(item >> ((3 - i) * 8));
   }
+  stream.write(data.data(), data.size());
 }
 
 static void dummy_quantizer(int width, int height, int *background_color, std::ostream &stream)
@@ -400,7 +514,7 @@ static void dummy_quantizer(int width, int height, int *background_color, std::o
 }
 
 void DummyQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+  const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
 {
   dummy_quantizer(width, height, background_color, stream);
 }
@@ -435,7 +549,7 @@ static inline unsigned char q2c(MagickLib::Quantum c)
 }
 
 void GraphicsMagickQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+  const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
 {
   if (out_fg == out_bg)
   { /* Don't bother to analyze images if they are obviously identical. */
@@ -449,28 +563,20 @@ void GraphicsMagickQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *o
   image.modifyImage();
   pdf::Pixmap bmp_fg(out_fg);
   pdf::Pixmap bmp_bg(out_bg);
-  pdf::Pixmap::iterator p_fg = bmp_fg.begin();
-  pdf::Pixmap::iterator p_bg = bmp_bg.begin();
+  std::vector<uint8_t> mask(width);
   for (int i = 0; i < 3; i++)
-    background_color[i] = p_bg[i];
+    background_color[i] = bmp_bg.get_row(0)[i];
   for (int y = 0; y < height; y++)
   {
+    dirty_region.get_row_mask(y, mask);
+    const uint8_t *p_fg = bmp_fg.get_row(y);
+    separate_row(p_fg, bmp_bg.get_row(y), mask.data(), width,
+      background_color, has_foreground, has_background);
     Magick::PixelPacket* ipixel = image.setPixels(0, y, width, 1);
-    for (int x = 0; x < width; x++)
+    for (int x = 0; x < width; x++, p_fg += 3)
     {
-      if (!has_background)
-      {
-        for (int i = 0; i < 3; i++)
-        if (background_color[i] != p_bg[i])
-        {
-          has_background = true;
-          break;
-        }
-      }
-      if (p_fg[0] != p_bg[0] || p_fg[1] != p_bg[1] || p_fg[2] != p_bg[2])
+      if (mask[x])
       {
-        if (!has_foreground && (p_fg[0] || p_fg[1] || p_fg[2]))
-          has_foreground = true;
         *ipixel = Magick::Color(
           c2q(p_fg[0]),
           c2q(p_fg[1]),
@@ -480,12 +586,8 @@ void GraphicsMagickQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *o
       }
       else
         *ipixel = Magick::Color(0, 0, 0, TransparentOpacity);
-      p_fg++;
-      p_bg++;
       ipixel++;
     }
-    p_fg.next_row();
-    p_bg.next_row();
     image.syncPixels();
   }
   image.quantizeColorSpace(Magick::TransparentColorspace);
@@ -545,7 +647,7 @@ GraphicsMagickQuantizer::GraphicsMagickQuantizer(const Config &config)
 }
 
 void GraphicsMagickQuantizer::operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-  int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
+  const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream)
 { /* just to satisfy compilers */ }
 
 #endif
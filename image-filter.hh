@@ -21,6 +21,7 @@
 
 #include "pdf-backend.hh"
 #include "config.hh"
+#include "dirty-region.hh"
 #include "i18n.hh"
 
 class Quantizer
@@ -29,7 +30,7 @@ protected:
   const Config &config;
 public:
   virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream) = 0;
+    const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream) = 0;
   explicit Quantizer(const Config &config) : config(config) { }
   virtual ~Quantizer()
   { }
@@ -42,7 +43,7 @@ public:
   : Quantizer(config)
   { }
   virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+    const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
 };
 
 class WebSafeQuantizer : public Quantizer
@@ -54,7 +55,7 @@ public:
   : Quantizer(config)
   { }
   virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+    const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
 };
 
 class MaskQuantizer : public Quantizer
@@ -64,7 +65,7 @@ public:
   : Quantizer(config)
   { }
   virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+    const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
 };
 
 class DummyQuantizer : public Quantizer
@@ -74,7 +75,7 @@ public:
   : Quantizer(config)
   { }
   virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+    const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
 };
 
 class GraphicsMagickQuantizer : public Quantizer
@@ -82,7 +83,7 @@ class GraphicsMagickQuantizer : public Quantizer
 public:
   explicit GraphicsMagickQuantizer(const Config &config);
   virtual void operator()(pdf::Renderer *out_fg, pdf::Renderer *out_bg, int width, int height,
-    int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
+    const DirtyRegion &dirty_region, int *background_color, bool &has_foreground, bool &has_background, std::ostream &stream);
   class NotImplementedError : public std::runtime_error
   {
   public:
@@ -16,14 +16,20 @@
 #include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <cmath>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <stdexcept>
@@ -31,13 +37,11 @@
 #include <utility>
 #include <vector>
 
-#if _OPENMP
-#include <omp.h>
-#endif
-
 #include "config.hh"
 #include "debug.hh"
+#include "dirty-region.hh"
 #include "djvu-const.hh"
+#include "djvu-iff.hh"
 #include "djvu-outline.hh"
 #include "i18n.hh"
 #include "image-filter.hh"
@@ -51,6 +55,7 @@
 #include "string-printf.hh"
 #include "string-utils.hh"
 #include "system.hh"
+#include "thread-pool.hh"
 #include "version.hh"
 #include "xmp.hh"
 
@@ -194,6 +199,11 @@ public:
     return this->file->get_basename();
   }
 
+  const File & get_file() const
+  {
+    return *this->file;
+  }
+
   std::streamoff size()
   {
     std::streamoff result;
@@ -203,6 +213,20 @@ public:
     return result;
   }
 
+  void read(djvu::Form &form)
+  {
+    this->file->reopen();
+    *this->file >> form;
+    this->file->close();
+  }
+
+  void write(const djvu::Form &form)
+  {
+    this->file->reopen(File::trunc);
+    *this->file << form;
+    this->file->close();
+  }
+
   friend std::ostream &operator <<(std::ostream &, const Component &);
   friend Command &operator <<(Command &, const Component &);
 };
@@ -261,6 +285,9 @@ protected:
 
 public:
 
+  virtual void write_shared_ant(const djvu::Form &form)
+  = 0;
+
   std::string get_title(int n, const std::string &label) const
   {
     string_format::Bindings bindings = this->get_bindings(n);
@@ -293,6 +320,18 @@ public:
 
 typedef pdf::Renderer MainRenderer;
 
+class CapturedGlyph
+/* A glyph that was not drawn by MutedRenderer, together with its fill color
+ * and the pixels it would have covered.
+ */
+{
+public:
+  int x, y, width, height;
+  uint8_t color[3];
+  std::string mask; // 1 bit per pixel, rows padded to whole bytes
+  std::string underlay; // RGB
+};
+
 class MutedRenderer: public pdf::Renderer
 {
 protected:
@@ -300,6 +339,134 @@ protected:
   std::vector<sexpr::Ref> annotations;
   const ComponentList &page_files;
   bool skipped_elements;
+  bool skipped_non_text;
+  bool glyphs_overpainted;
+  std::vector<CapturedGlyph> glyphs;
+  pdf::splash::Bitmap *page_bitmap;
+  DirtyRegion dirty_region;
+  RecordFilter *text_filter;
+
+  void skip_non_text()
+  {
+    this->skipped_elements = true;
+    this->skipped_non_text = true;
+  }
+
+  void mark_dirty(double x0, double y0, double x1, double y1, double margin = 2.0)
+  {
+    if (this->getBitmap() != this->page_bitmap)
+      /* Inside a transparency group (or a soft mask), coordinates are not
+       * page coordinates, and the difference may spread anywhere. */
+      this->dirty_region.add_all();
+    else
+      this->dirty_region.add(x0, y0, x1, y1, margin);
+  }
+
+  void mark_image_dirty(pdf::gfx::State *state)
+  {
+    /* The image occupies the unit square in user space: */
+    double x0, y0, x1, y1;
+    state->transform(0, 0, &x0, &y0);
+    x1 = x0; y1 = y0;
+    for (int i = 1; i < 4; i++)
+    {
+      double x, y;
+      state->transform(i & 1, i >> 1, &x, &y);
+      x0 = std::min(x0, x); x1 = std::max(x1, x);
+      y0 = std::min(y0, y); y1 = std::max(y1, y);
+    }
+    this->mark_dirty(x0, y0, x1, y1);
+  }
+
+  void mark_path_dirty(pdf::gfx::State *state, double margin = 2.0)
+  {
+    // for POPPLER_VERSION >= 8300:
+    //   const pdf::gfx::Path *path
+    auto path = state->getPath();
+    bool empty = true;
+    double x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    for (int i = 0; i < path->getNumSubpaths(); i++)
+    {
+      auto subpath = path->getSubpath(i);
+      for (int j = 0; j < subpath->getNumPoints(); j++)
+      {
+        /* Bézier curves lie within the convex hull of their control points. */
+        double x, y;
+        state->transform(subpath->getX(j), subpath->getY(j), &x, &y);
+        if (empty)
+        {
+          x0 = x1 = x;
+          y0 = y1 = y;
+          empty = false;
+          continue;
+        }
+        x0 = std::min(x0, x); x1 = std::max(x1, x);
+        y0 = std::min(y0, y); y1 = std::max(y1, y);
+      }
+    }
+    if (!empty)
+      this->mark_dirty(x0, y0, x1, y1, margin);
+  }
+
+  static double get_stroke_margin(pdf::gfx::State *state)
+  {
+    /* getTransformedLineWidth() averages the scale factors of the CTM, so it
+     * underestimates the width under anisotropic transformations. The
+     * Frobenius norm of the CTM bounds the largest scale factor instead. */
+    const double *ctm = state->getCTM();
+    double scale = std::hypot(std::hypot(ctm[0], ctm[1]), std::hypot(ctm[2], ctm[3]));
+    double line_width = std::max(state->getLineWidth() * scale, 1.0);
+    /* Miter joins can stick out up to miter_limit * line_width / 2. */
+    return 2.0 + line_width * std::max(state->getMiterLimit(), 1.0) / 2;
+  }
+
+  void before_painting()
+  {
+    if (!this->glyphs.empty())
+      this->glyphs_overpainted = true;
+  }
+
+  bool capture_glyph(pdf::gfx::State *state, int render, const pdf::splash::GlyphBitmap &glyph, int x, int y)
+  /* Remember the glyph, so that it can be composited onto the foreground
+   * later on. Only opaque, solid-colored, non-anti-aliased glyphs, drawn
+   * directly onto the page and not clipped, are supported.
+   */
+  {
+    if (config.monochrome)
+      return false;
+    if (render != 0 || glyph.aa)
+      return false;
+    pdf::splash::Bitmap *bitmap = this->getBitmap();
+    if (bitmap != this->page_bitmap || bitmap->getMode() != splashModeRGB8)
+      /* e.g. inside a transparency group */
+      return false;
+    if (state->getFillColorSpace()->getMode() == csPattern)
+      return false;
+    if (state->getFillOpacity() != 1.0 || state->getBlendMode() != gfxBlendNormal)
+      return false;
+    if (this->getSplash()->getSoftMask() != nullptr || state->getTransfer()[0] != nullptr)
+      return false;
+    if (x < 0 || y < 0 || x + glyph.w > bitmap->getWidth() || y + glyph.h > bitmap->getHeight())
+      return false;
+    CapturedGlyph captured;
+    captured.x = x;
+    captured.y = y;
+    captured.width = glyph.w;
+    captured.height = glyph.h;
+    pdf::gfx::RgbColor rgb;
+    state->getFillRGB(&rgb);
+    captured.color[0] = pdf::gfx::color_component_as_byte(rgb.r);
+    captured.color[1] = pdf::gfx::color_component_as_byte(rgb.g);
+    captured.color[2] = pdf::gfx::color_component_as_byte(rgb.b);
+    size_t mask_row_size = (glyph.w + 7) / 8;
+    captured.mask.assign(reinterpret_cast<const char*>(glyph.data), mask_row_size * glyph.h);
+    const uint8_t *data = bitmap->getDataPtr();
+    size_t row_size = bitmap->getRowSize();
+    for (int j = 0; j < glyph.h; j++)
+      captured.underlay.append(reinterpret_cast<const char*>(data + (y + j) * row_size + 3 * x), 3 * glyph.w);
+    this->glyphs.push_back(std::move(captured));
+    return true;
+  }
 
   void add_text_comment(int ox, int oy, int dx, int dy, int x, int y, int w, int h, const Unicode *unistr, int len)
   {
@@ -334,10 +501,18 @@ public:
     return !config.no_render;
   }
 
+  void startPage(int page_no, pdf::gfx::State *state, pdf::XRef *xref)
+  {
+    Renderer::startPage(page_no, state, xref);
+    this->page_bitmap = this->getBitmap();
+    this->dirty_region.reset(this->getBitmapWidth(), this->getBitmapHeight());
+  }
+
   void drawImageMask(pdf::gfx::State *state, pdf::Object *object, pdf::Stream *stream, int width, int height,
     bool invert, bool interpolate, bool inline_image)
   {
-    this->skipped_elements = true;
+    this->skip_non_text();
+    this->mark_image_dirty(state);
     return;
   }
 
@@ -351,9 +526,11 @@ public:
   {
     if (is_foreground_color_map(color_map) || config.no_render)
     {
-      this->skipped_elements = true;
+      this->skip_non_text();
+      this->mark_image_dirty(state);
       return;
     }
+    this->before_painting();
     Renderer::drawImage(state, object, stream, width, height, color_map,
       interpolate, mask_colors, inline_image);
   }
@@ -364,9 +541,11 @@ public:
   {
     if (is_foreground_color_map(color_map) || config.no_render)
     {
-      this->skipped_elements = true;
+      this->skip_non_text();
+      this->mark_image_dirty(state);
       return;
     }
+    this->before_painting();
     Renderer::drawMaskedImage(state, object, stream, width, height,
       color_map, interpolate,
       mask_stream, mask_width, mask_height, mask_invert, mask_interpolate);
@@ -379,9 +558,11 @@ public:
   {
     if (is_foreground_color_map(color_map) || config.no_render)
     {
-      this->skipped_elements = true;
+      this->skip_non_text();
+      this->mark_image_dirty(state);
       return;
     }
+    this->before_painting();
     Renderer::drawSoftMaskedImage(state, object, stream, width, height,
       color_map, interpolate,
       mask_stream, mask_width, mask_height, mask_color_map, mask_interpolate);
@@ -406,21 +587,51 @@ public:
      * fonts to be set up properly nevertheless:
      */
     state->setRender(0x103);
-    this->skipped_elements = true;
+    /* Invisible text (typically an OCR layer over a scanned image) would not
+     * change the second rendering pass; don't request it: */
+    if (old_render != 3)
+      this->skipped_elements = true;
     this->Renderer::drawChar(state, x, y, dx, dy, origin_x, origin_y, code, n_bytes, unistr, length);
     state->setRender(old_render);
     pdf::splash::Font *font = this->getCurrentFont();
     pdf::splash::GlyphBitmap glyph;
+    pdf::splash::ClipResult clip_result;
     px = pox; py = poy;
-    if (pdf::get_glyph(this->getSplash(), font, pox, poy, code, &glyph))
+    if (pdf::get_glyph(this->getSplash(), font, pox, poy, code, &glyph, &clip_result))
     {
       px -= glyph.x;
       py -= glyph.y;
       pw = glyph.w;
       ph = glyph.h;
+      if (old_render != 3)
+      {
+        int gx = static_cast<int>(std::floor(pox)) - glyph.x;
+        int gy = static_cast<int>(std::floor(poy)) - glyph.y;
+        /* get_glyph() truncates the position rather than rounding it down,
+         * so for negative coordinates its clipping test doesn't match where
+         * the glyph is painted: */
+        const bool captured =
+          pox >= 0 && poy >= 0 &&
+          clip_result == splashClipAllInside &&
+          this->capture_glyph(state, old_render, glyph, gx, gy);
+        if (!captured)
+          this->skipped_non_text = true;
+        if (old_render & 4)
+          /* Text clipping affects everything drawn afterwards. */
+          this->dirty_region.add_all();
+        else if (old_render == 0)
+          this->mark_dirty(gx, gy, gx + glyph.w, gy + glyph.h);
+        else
+          this->mark_dirty(gx, gy, gx + glyph.w, gy + glyph.h, get_stroke_margin(state));
+      }
     }
     else
     {
+      if (old_render != 3)
+      {
+        this->skipped_non_text = true;
+        this->dirty_region.add_all();
+      }
       /* Ideally, this should never happen. Some heuristics is required to
        * determine character width/height: */
       pw = pdx; ph = pdy;
@@ -592,23 +803,31 @@ public:
 
   void stroke(pdf::gfx::State *state)
   {
-    this->skipped_elements = true;
+    this->skip_non_text();
+    this->mark_path_dirty(state, get_stroke_margin(state));
   }
 
   void fill(pdf::gfx::State *state)
   {
     if (config.no_render)
     {
-      this->skipped_elements = true;
+      this->skip_non_text();
+      this->mark_path_dirty(state);
       return;
     }
     pdf::splash::Path path;
     this->convert_path(state, path);
     double area = pdf::get_path_area(path);
     if (area / this->getBitmapHeight() / this->getBitmapWidth() >= 0.8)
+    {
+      this->before_painting();
       Renderer::fill(state);
+    }
     else
-      this->skipped_elements = true;
+    {
+      this->skip_non_text();
+      this->mark_path_dirty(state);
+    }
   }
 
   void eoFill(pdf::gfx::State *state)
@@ -616,8 +835,8 @@ public:
     this->fill(state);
   }
 
-  MutedRenderer(pdf::splash::Color &paper_color, bool monochrome, const ComponentList &page_files)
-  : Renderer(paper_color, monochrome), page_files(page_files)
+  MutedRenderer(pdf::splash::Color &paper_color, bool monochrome, const ComponentList &page_files, RecordFilter *text_filter)
+  : Renderer(paper_color, monochrome), page_files(page_files), page_bitmap(nullptr), text_filter(text_filter)
   {
     this->clear();
   }
@@ -635,7 +854,9 @@ public:
   const std::string get_texts() const
   {
     std::string texts = this->text_comments->str();
-    if (config.text_filter_command_line.length() > 0)
+    if (this->text_filter)
+      texts = (*this->text_filter)(texts);
+    else if (config.text_filter_command_line.length() > 0)
       texts = Command::filter(config.text_filter_command_line, texts);
     for (char &c : texts)
       switch (c)
@@ -659,6 +880,9 @@ public:
   void clear()
   {
     this->skipped_elements = 0;
+    this->skipped_non_text = false;
+    this->glyphs_overpainted = false;
+    this->glyphs.clear();
     this->clear_texts();
     this->clear_annotations();
   }
@@ -667,6 +891,56 @@ public:
   {
     return this->skipped_elements;
   }
+
+  const DirtyRegion &get_dirty_region() const
+  {
+    return this->dirty_region;
+  }
+
+  bool composite_text(pdf::Renderer *renderer)
+  /* If only text was skipped, draw the captured glyphs onto a copy of the
+   * bitmap, and hand it over to the renderer, so that the page doesn't need
+   * to be rendered second time.
+   * Return false if this is not possible.
+   */
+  {
+    if (this->skipped_non_text || this->glyphs_overpainted)
+      return false;
+    pdf::splash::Bitmap *bitmap = this->getBitmap();
+    if (bitmap != this->page_bitmap)
+      return false;
+    int width = bitmap->getWidth();
+    int height = bitmap->getHeight();
+    const uint8_t *data = bitmap->getDataPtr();
+    size_t row_size = bitmap->getRowSize();
+    for (const CapturedGlyph &glyph : this->glyphs)
+    {
+      /* Make sure that nothing was painted over the glyph afterwards: */
+      size_t glyph_row_size = 3 * glyph.width;
+      for (int j = 0; j < glyph.height; j++)
+        if (std::memcmp(data + (glyph.y + j) * row_size + 3 * glyph.x, glyph.underlay.data() + j * glyph_row_size, glyph_row_size) != 0)
+          return false;
+    }
+    std::unique_ptr<pdf::splash::Bitmap> fg_bitmap(new pdf::splash::Bitmap(width, height, 4, splashModeRGB8, false));
+    uint8_t *fg_data = fg_bitmap->getDataPtr();
+    size_t fg_row_size = fg_bitmap->getRowSize();
+    for (int y = 0; y < height; y++)
+      std::memcpy(fg_data + y * fg_row_size, data + y * row_size, 3 * width);
+    for (const CapturedGlyph &glyph : this->glyphs)
+    {
+      size_t mask_row_size = (glyph.width + 7) / 8;
+      for (int j = 0; j < glyph.height; j++)
+      {
+        const uint8_t *mask = reinterpret_cast<const uint8_t*>(glyph.mask.data()) + j * mask_row_size;
+        uint8_t *p = fg_data + (glyph.y + j) * fg_row_size + 3 * glyph.x;
+        for (int i = 0; i < glyph.width; i++, p += 3)
+          if (mask[i / 8] & (0x80 >> (i % 8)))
+            std::copy(glyph.color, glyph.color + 3, p);
+      }
+    }
+    renderer->set_bitmap(fg_bitmap.release());
+    return true;
+  }
 };
 
 class BookmarkError : public std::runtime_error
@@ -787,18 +1061,20 @@ static void pdf_outline_to_djvu_outline(pdf::Document &doc, djvu::Outline &djvu_
   pdf_outline_to_djvu_outline(pdf_outline, catalog, djvu_outline, page_files, 0);
 }
 
-static void add_meta_string(const char *key, const std::string &value, std::ostream &stream)
+static void add_meta_string(const char *key, const std::string &value, sexpr::Ref &expr)
 {
-  sexpr::Ref expr = sexpr::string(value);
-  stream << key << "\t" << expr << std::endl;
+  if (value.length() == 0)
+    return;
+  sexpr::Ref item = sexpr::cons(sexpr::string(value), sexpr::nil);
+  item = sexpr::cons(sexpr::symbol(key), item);
+  expr = sexpr::cons(item, expr);
 }
 
-static void add_meta_date(const char *key, const pdf::Timestamp &value, std::ostream &stream)
+static void add_meta_date(const char *key, const pdf::Timestamp &value, sexpr::Ref &expr)
 {
   try
   {
-    sexpr::Ref sexpr = sexpr::string(value.format(' '));
-    stream << key << "\t" << sexpr << std::endl;
+    add_meta_string(key, value.format(' '), expr);
   }
   catch (const pdf::Timestamp::Invalid &)
   {
@@ -808,32 +1084,64 @@ static void add_meta_date(const char *key, const pdf::Timestamp &value, std::ost
 
 static void pdf_metadata_to_djvu_metadata(const pdf::Metadata &metadata, std::ostream &stream)
 {
-  metadata.iterate<std::ostream>(add_meta_string, add_meta_date, stream);
+  static sexpr::Ref metadata_symbol = sexpr::symbol("metadata");
+  sexpr::Ref expr = sexpr::nil;
+  metadata.iterate<sexpr::Ref>(add_meta_string, add_meta_date, expr);
+  if (expr == sexpr::nil)
+    return;
+  expr.reverse();
+  expr = sexpr::cons(metadata_symbol, expr);
+  stream << expr << std::endl;
 }
 
+class TemporaryComponentFile : public TemporaryFile
+/* Anonymous temporary file that stores a component of a bundled document.
+ * Components are copied into the bundle by pdf2djvu itself, so they don't
+ * need to live in a directory under their own names; this lets them be
+ * kept in memory.
+ */
+{
+public:
+  explicit TemporaryComponentFile(const std::string &base_name)
+  : TemporaryFile()
+  {
+    this->base_name = base_name;
+  }
+};
+
 class TemporaryComponentList : public ComponentList
 {
 private:
   TemporaryComponentList(const TemporaryComponentList&) = delete;
   TemporaryComponentList& operator=(const TemporaryComponentList&) = delete;
 protected:
-  std::unique_ptr<const TemporaryDirectory> directory;
   std::unique_ptr<TemporaryFile> shared_ant_file;
 
   virtual File *create_file(const std::string &page_id)
   {
-    return new TemporaryFile(*this->directory, page_id);
+    return new TemporaryComponentFile(page_id);
   }
 public:
   explicit TemporaryComponentList(int n, const PageMap &page_map)
   : ComponentList(n, page_map),
-    directory(new TemporaryDirectory()),
-    shared_ant_file(new TemporaryFile(*directory, djvu::shared_ant_file_name))
+    shared_ant_file(new TemporaryComponentFile(djvu::shared_ant_file_name))
   {
     shared_ant_file->write("AT&TFORM\0\0\0\4DJVI", 16);
     shared_ant_file->close();
   }
 
+  Component get_shared_ant() const
+  {
+    return Component(*this->shared_ant_file);
+  }
+
+  virtual void write_shared_ant(const djvu::Form &form)
+  {
+    this->shared_ant_file->reopen(File::trunc);
+    *this->shared_ant_file << form;
+    this->shared_ant_file->close();
+  }
+
   virtual ~TemporaryComponentList()
   {
     this->clean_files();
@@ -855,6 +1163,13 @@ public:
   IndirectComponentList(int n, const PageMap &page_map, const Directory &directory)
   : ComponentList(n, page_map), directory(directory)
   { }
+
+  virtual void write_shared_ant(const djvu::Form &form)
+  {
+    File file(this->directory, djvu::shared_ant_file_name);
+    file << form;
+    file.close();
+  }
 };
 
 class DjVuCommand : public Command
@@ -885,10 +1200,27 @@ public:
   { }
 };
 
+static void bzz_encode(const std::string &data, std::ostream &stream)
+{
+  std::istringstream input(data);
+  DjVuCommand bzz("bzz");
+  bzz << "-e" << "-" << "-";
+  bzz(input, stream); // bzz -e - - < <data> > <stream>
+}
+
+static void print_int(std::ostream &stream, size_t value, int n_bytes)
+{
+  for (int i = n_bytes - 1; i >= 0; i--)
+    stream << static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
 class DjVm
 {
 protected:
   std::set<std::string> known_ids;
+  std::vector<Component> components;
+  bool needs_shared_ant;
+  std::unique_ptr<std::ostringstream> outline_stream;
   class DuplicateId : public std::runtime_error
   {
   public:
@@ -897,16 +1229,47 @@ protected:
     { }
   };
   void remember(const Component &component);
+  std::string get_dirm_data(const std::vector<std::streamoff> &sizes) const;
+  std::string encode_dirm(const std::vector<std::streamoff> &sizes) const;
+  std::string encode_navm() const;
+  DjVm()
+  : needs_shared_ant(false)
+  { }
 public:
-  virtual void add(const Component &component) = 0;
+  virtual void add(const Component &component)
+  {
+    this->remember(component);
+    this->components.push_back(component);
+  }
+  virtual void begin()
+  /* Called once all the components were added, and the outline and shared
+   * annotations are set, but before any of the components is encoded.
+   */
+  { }
+  virtual void complete(size_t n)
+  /* Called when the n-th component (counting from 0) is encoded. */
+  { }
   virtual void commit() = 0;
   DjVm &operator <<(const Component &component)
   {
     this->add(component);
     return *this;
   }
-  virtual void set_outline(const djvu::Outline &outline) = 0;
-  virtual void set_metadata(File &metadata_sed_file) = 0;
+  virtual void set_outline(const djvu::Outline &outline)
+  {
+    if (!outline)
+    {
+      this->outline_stream.reset(nullptr);
+      return;
+    }
+    this->outline_stream.reset(new std::ostringstream);
+    *this->outline_stream << outline;
+  }
+  virtual void require_shared_ant()
+  {
+    this->needs_shared_ant = true;
+  }
+  virtual std::streamoff size() const = 0;
   virtual ~DjVm() { /* just to silence compilers */ }
 };
 
@@ -919,240 +1282,337 @@ void DjVm::remember(const Component &component)
   this->known_ids.insert(id);
 }
 
-class IndirectDjVm;
+std::string DjVm::get_dirm_data(const std::vector<std::streamoff> &sizes) const
+/* Return uncompressed data of the BZZ-compressed part of the DIRM chunk.
+ * Component sizes are meaningful only for bundled documents; for indirect
+ * ones, ``sizes`` should be empty.
+ */
+{
+  bool shared_ant = this->needs_shared_ant;
+  std::ostringstream dirm;
+  for (size_t i = 0; i < this->components.size() + shared_ant; i++)
+    print_int(dirm, i < sizes.size() ? sizes[i] : 0, 3);
+  if (shared_ant)
+    dirm << '\3';
+  for (const Component &component : this->components)
+    dirm << (component.get_title().length() == 0 ? '\001' : '\101');
+  if (shared_ant)
+    dirm << djvu::shared_ant_file_name << '\0';
+  for (const Component &component : this->components)
+  {
+    dirm << component.get_basename() << '\0';
+    const std::string &title = component.get_title();
+    if (title.length() == 0)
+      continue;
+    dirm << title << '\0';
+  }
+  return dirm.str();
+}
+
+std::string DjVm::encode_dirm(const std::vector<std::streamoff> &sizes) const
+{
+  std::ostringstream stream;
+  bzz_encode(this->get_dirm_data(sizes), stream);
+  return stream.str();
+}
+
+std::string DjVm::encode_navm() const
+/* Return the whole NAVM chunk, or an empty string if there's no outline. */
+{
+  if (!this->outline_stream.get())
+    return "";
+  std::ostringstream navm;
+  bzz_encode(this->outline_stream->str(), navm);
+  const std::string &data = navm.str();
+  std::ostringstream stream;
+  stream << "NAVM";
+  print_int(stream, data.size(), 4);
+  stream << data;
+  return stream.str();
+}
 
 class BundledDjVm : public DjVm
+/* Bundled document is written in one pass: the component sizes are known
+ * in advance, so the DIRM offsets can be calculated before any component is
+ * written out.
+ *
+ * If the output is seekable, the components are instead written as soon as
+ * they are encoded (in order), after a region reserved for the directory.
+ * Only the directory is then written at the end.
+ */
 {
 protected:
-  size_t size;
-  File &output_file;
-  DjVuCommand converter;
-  std::unique_ptr<IndirectDjVm> indirect_djvm;
-  std::unique_ptr<TemporaryFile> index_file;
+  RawOutput &output;
+  Component shared_ant;
+  std::streamoff output_size;
+  bool streaming;
+  size_t dirm_size;
+  std::string navm;
+  std::mutex completion_mutex;
+  std::vector<bool> completed;
+  size_t n_written;
+  bool writing;
+  std::vector<std::streamoff> offsets;
+  std::vector<std::streamoff> sizes;
+  std::vector<Component> get_files() const;
+  std::streamoff get_header_size() const;
+  bool dirm_fits(size_t used_size) const;
+  std::string get_header(const std::string &dirm_bzz, std::streamoff end) const;
+  void write_file(Component &file);
 public:
-  explicit BundledDjVm(File &output_file)
-  : size(0),
-    output_file(output_file),
-    converter("djvmcvt")
+  BundledDjVm(RawOutput &output, const Component &shared_ant)
+  : output(output),
+    shared_ant(shared_ant),
+    output_size(0),
+    streaming(false),
+    dirm_size(0),
+    n_written(0),
+    writing(false)
   { }
-  ~BundledDjVm()
-  { }
-  virtual void add(const Component &component);
   virtual void set_outline(const djvu::Outline &outline);
-  virtual void set_metadata(File &metadata_sed_file);
+  virtual void begin();
+  virtual void complete(size_t n);
   virtual void commit();
+  virtual std::streamoff size() const
+  {
+    return this->output_size;
+  }
 };
 
-class IndirectDjVm : public DjVm
+void BundledDjVm::set_outline(const djvu::Outline &outline)
 {
-protected:
-  File &index_file;
-  std::vector<Component> components;
-  bool needs_shared_ant;
-  std::unique_ptr<std::ostringstream> outline_stream;
-  class UnexpectedDjvuSedOutput : public std::runtime_error
-  {
-  public:
-    UnexpectedDjvuSedOutput()
-    : std::runtime_error(_("Unexpected output from djvused"))
-    { }
-  };
-  void create_bare(const std::vector<Component> &components);
-  void create(const std::vector<Component> &components, bool bare=false);
-public:
-  explicit IndirectDjVm(File &index_file)
-  : index_file(index_file),
-    needs_shared_ant(false)
-  { }
+  this->DjVm::set_outline(outline);
+  if (this->components.size() < 2)
+    /* Some old DjVuLibre versions (at least 3.5.23) don't preserve outline in
+     * single-page documents without shared annotation chunk. Let's work around
+     * this problem. */
+    this->require_shared_ant();
+}
 
-  virtual ~IndirectDjVm()
-  { }
+std::vector<Component> BundledDjVm::get_files() const
+{
+  std::vector<Component> files;
+  if (this->needs_shared_ant)
+    files.push_back(this->shared_ant);
+  files.insert(files.end(), this->components.begin(), this->components.end());
+  return files;
+}
 
-  virtual void add(const Component &component)
-  {
-    this->remember(component);
-    this->components.push_back(component);
-  }
+std::streamoff BundledDjVm::get_header_size() const
+{
+  std::streamoff size = 24 + this->dirm_size;
+  size += size & 1;
+  return size + this->navm.size();
+}
 
-  virtual void set_outline(const djvu::Outline &outline)
-  {
-    if (!outline)
-    {
-      this->outline_stream.reset(nullptr);
-      return;
-    }
-    this->outline_stream.reset(new std::ostringstream);
-    *this->outline_stream << outline;
-  }
+bool BundledDjVm::dirm_fits(size_t used_size) const
+/* Check if a DIRM chunk with ``used_size`` bytes of data fits into the space
+ * reserved for it. The unused space must be large enough for a padding chunk.
+ */
+{
+  size_t reserved_size = this->dirm_size + (this->dirm_size & 1);
+  size_t padded_size = used_size + (used_size & 1);
+  if (padded_size > reserved_size)
+    return false;
+  size_t free_size = reserved_size - padded_size;
+  return free_size == 0 || free_size >= 8 + (this->navm.size() & 1);
+}
 
-  virtual void set_metadata(File &metadata_sed_file)
-  {
-    size_t size = this->components.size();
+std::string BundledDjVm::get_header(const std::string &dirm_bzz, std::streamoff end) const
+/* Return everything that precedes the first component. If the directory is
+ * smaller than the space reserved for it, the rest of the space is taken by
+ * a padding chunk after the NAVM chunk; DjVu decoders skip unknown chunks.
+ */
+{
+  size_t used_size = 3 + 4 * this->offsets.size() + dirm_bzz.size();
+  assert(this->dirm_fits(used_size));
+  if (static_cast<uintmax_t>(end) > 0xFFFFFFFFU)
+    throw djvu::IFFError();
+  std::ostringstream header;
+  header << "AT&TFORM";
+  print_int(header, end - 12, 4);
+  header << "DJVMDIRM";
+  print_int(header, used_size, 4);
+  header << '\x81';
+  print_int(header, this->offsets.size(), 2);
+  for (std::streamoff offset : this->offsets)
+    print_int(header, offset, 4);
+  header << dirm_bzz;
+  if (used_size & 1)
+    header << '\0';
+  header << this->navm;
+  std::streamoff padding_size = this->get_header_size() - header.str().size();
+  if (padding_size > 0)
+  {
+    if (this->navm.size() & 1)
     {
-      /* Using ``djvused`` to add shared annotations to an indirect multi-page
-       * document could be unacceptably slow:
-       * https://sourceforge.net/p/djvu/bugs/100/
-       *
-       * We need to work around this bug.
-       */
-      debug(3) << _("setting metadata with `djvused`") << std::endl;
-      std::vector<Component> dummy_components;
-      TemporaryFile dummy_sed_file;
-      /* For an indirect document, ``create-shared-ant`` is, surprisingly, not
-       * enough to create a shared annotations chunk. The dummy shared
-       * annotation is actually required.
-       */
-      dummy_sed_file
-        << "create-shared-ant" << std::endl
-        << "set-ant" << std::endl
-        << "(x)" << std::endl
-        << "." << std::endl;
-      dummy_sed_file.close();
-      for (size_t i = 0; i < size - 1; i++)
-      {
-        /* To make the page include the annotations chunk:
-         * - Create an ephemeral indirect multi-page document with just this
-         *   single page.
-         * - Add the dummy shared annotation.
-         */
-        dummy_components.push_back(this->components[i]);
-        this->create_bare(dummy_components);
-        DjVuCommand djvused("djvused");
-        djvused << "-s" << "-f" << dummy_sed_file << this->index_file;
-        djvused(); // djvused -s -f <dummy-sed-file> <output-djvu-file>
-        dummy_components.pop_back();
-      }
-      /* For the last page, use the desired annotations. */
-      dummy_components.push_back(this->components[size - 1]);
-      this->create_bare(dummy_components);
-      DjVuCommand djvused("djvused");
-      djvused << "-s" << "-f" << metadata_sed_file << this->index_file;
-      djvused(); // djvused -s -f <metadata-sed-file> <output-djvu-file>
-      this->needs_shared_ant = true;
+      header << '\0';
+      padding_size--;
     }
+    assert(padding_size >= 8);
+    header << "PAD ";
+    print_int(header, padding_size - 8, 4);
+    header << std::string(padding_size - 8, '\0');
   }
+  assert(static_cast<std::streamoff>(header.str().size()) == this->get_header_size());
+  return header.str();
+}
 
-  virtual void commit()
-  {
-    size_t size = this->components.size();
-    debug(3)
-      << string_printf(ngettext(
-           "creating multi-page indirect document (%zu page)",
-           "creating multi-page indirect document (%zu pages)",
-           size), size
-         )
-      << std::endl;
-    this->create(this->components);
-  }
-
-  void require_shared_ant()
-  {
-    this->needs_shared_ant = true;
-  }
-
-};
-
-void BundledDjVm::add(const Component &component)
+void BundledDjVm::write_file(Component &file)
 {
-  if (this->index_file.get() == nullptr)
-  {
-    std::ostringstream stream;
-    stream << component << ".djvu-index";
-    this->index_file.reset(new TemporaryFile(stream.str()));
-    this->indirect_djvm.reset(new IndirectDjVm(*this->index_file));
-  }
-  /* No need to call ``this->remember(component)``. */
-  *this->indirect_djvm << component;
-  this->size++;
+  /* Component files start with the "AT&T" magic, which is not a part of the
+   * FORM chunk: */
+  std::streamoff size = file.size() - 4;
+  if (this->output.tell() & 1)
+    this->output.write("", 1);
+  this->offsets.push_back(this->output.tell());
+  this->sizes.push_back(size);
+  this->output.copy(file.get_file(), 4, size);
 }
 
-void BundledDjVm::set_outline(const djvu::Outline &outline)
+void BundledDjVm::begin()
 {
-  this->indirect_djvm->set_outline(outline);
-  if (this->size < 2)
-    /* Some old DjVuLibre versions (at least 3.5.23) don't preserve outline in
-     * single-page documents without shared annotation chunk. Let's work around
-     * this problem. */
-    this->indirect_djvm->require_shared_ant();
+  if (!this->output.is_seekable())
+    return;
+  std::vector<Component> files = this->get_files();
+  /* The directory is not known yet, so reserve some space for it. Component
+   * sizes take 3 bytes each, and they are hardly compressible: */
+  std::vector<std::streamoff> sizes(files.size(), 0);
+  this->dirm_size = 3 + 4 * files.size() + this->encode_dirm(sizes).size() + 3 * files.size() + 64;
+  this->navm = this->encode_navm();
+  this->output.write(std::string(this->get_header_size(), '\0'));
+  this->streaming = true;
+  this->completed.assign(this->components.size(), false);
+  if (this->needs_shared_ant)
+    this->write_file(this->shared_ant);
 }
 
-void BundledDjVm::set_metadata(File &metadata_sed_file)
+void BundledDjVm::complete(size_t n)
+/* Components are copied by whichever thread completes the next one to be
+ * written. Only the bookkeeping is done under the lock, so that the other
+ * threads don't wait for the copying.
+ */
 {
-  this->indirect_djvm->set_metadata(metadata_sed_file);
+  if (!this->streaming)
+    return;
+  std::unique_lock<std::mutex> lock(this->completion_mutex);
+  this->completed.at(n) = true;
+  if (this->writing)
+    return;
+  this->writing = true;
+  while (this->n_written < this->components.size() && this->completed[this->n_written])
+  {
+    Component &component = this->components[this->n_written];
+    lock.unlock();
+    this->write_file(component);
+    lock.lock();
+    this->n_written++;
+  }
+  this->writing = false;
 }
 
 void BundledDjVm::commit()
 {
-  this->indirect_djvm->commit();
-  this->converter
-    << "-b"
-    << *this->index_file
-    << this->output_file;
-  this->converter(); // djvmcvt -b <output-djvu-file> <index-djvu-file>
-  this->index_file.reset(nullptr);
+  size_t n_pages = this->components.size();
+  debug(3)
+    << string_printf(ngettext(
+         "creating multi-page bundled document (%zu page)",
+         "creating multi-page bundled document (%zu pages)",
+         n_pages), n_pages
+       )
+    << std::endl;
+  if (this->streaming)
+  {
+    assert(this->n_written == n_pages);
+    std::string dirm_bzz = this->encode_dirm(this->sizes);
+    if (this->dirm_fits(3 + 4 * this->offsets.size() + dirm_bzz.size()))
+    {
+      this->output_size = this->output.tell();
+      this->output.seek(0);
+      this->output.write(this->get_header(dirm_bzz, this->output_size));
+      this->output.close();
+      return;
+    }
+    /* The reserved space is too small. Rewrite the whole document: */
+    this->output.seek(0);
+  }
+  std::vector<Component> files = this->get_files();
+  this->sizes.clear();
+  for (Component &file : files)
+    this->sizes.push_back(file.size() - 4);
+  std::string dirm_bzz = this->encode_dirm(this->sizes);
+  this->dirm_size = 3 + 4 * files.size() + dirm_bzz.size();
+  this->navm = this->encode_navm();
+  std::streamoff offset = this->get_header_size();
+  this->offsets.clear();
+  for (std::streamoff size : this->sizes)
+  {
+    offset += offset & 1;
+    this->offsets.push_back(offset);
+    offset += size;
+  }
+  this->output.write(this->get_header(dirm_bzz, offset));
+  std::vector<std::streamoff> offsets;
+  offsets.swap(this->offsets);
+  this->sizes.clear();
+  for (Component &file : files)
+    this->write_file(file);
+  assert(this->offsets == offsets);
+  this->output_size = this->output.tell();
+  this->output.close();
 }
 
-void IndirectDjVm::create_bare(const std::vector<Component> &components)
+class IndirectDjVm : public DjVm
 {
-  this->create(components, true);
-}
+protected:
+  File &index_file;
+  std::streamoff index_size;
+public:
+  explicit IndirectDjVm(File &index_file)
+  : index_file(index_file),
+    index_size(0)
+  { }
+
+  virtual ~IndirectDjVm()
+  { }
 
-void IndirectDjVm::create(const std::vector<Component> &components, bool bare)
+  virtual void commit();
+
+  virtual std::streamoff size() const
+  {
+    return this->index_size;
+  }
+};
+
+void IndirectDjVm::commit()
 {
-  size_t size = components.size();
+  size_t size = this->components.size();
+  debug(3)
+    << string_printf(ngettext(
+         "creating multi-page indirect document (%zu page)",
+         "creating multi-page indirect document (%zu pages)",
+         size), size
+       )
+    << std::endl;
+  std::string dirm_bzz = this->encode_dirm(std::vector<std::streamoff>());
+  size_t dirm_size = 3 + dirm_bzz.size();
+  std::string navm = this->encode_navm();
+  std::streamoff offset = 24 + dirm_size;
+  offset += offset & 1;
+  offset += navm.size();
   this->index_file.reopen(File::trunc); // (re)open and truncate
-  this->index_file.write("AT&TFORM\0\0\0\0DJVMDIRM\0\0\0\0\1", 25);
-  bool shared_ant = !bare && this->needs_shared_ant;
-  for (int i = 1; i >= 0; i--)
-    index_file << static_cast<char>(((size + shared_ant) >> (8 * i)) & 0xFF);
-  {
-    TemporaryFile bzz_file;
-    for (size_t i = 0; i < size + shared_ant; i++)
-      bzz_file.write("\0\0", 3);
-    if (shared_ant)
-      bzz_file << '\3';
-    for (const Component &component : components)
-      bzz_file << (component.get_title().length() == 0 ? '\001' : '\101');
-    if (shared_ant)
-      bzz_file << djvu::shared_ant_file_name << '\0';
-    for (const Component &component : components)
-    {
-      bzz_file << component.get_basename() << '\0';
-      const std::string &title = component.get_title();
-      if (title.length() == 0)
-        continue;
-      bzz_file << title << '\0';
-    }
-    bzz_file.close();
-    DjVuCommand bzz("bzz");
-    bzz << "-e" << bzz_file << "-";
-    bzz(index_file);
-  }
-  std::streamoff dirm_off = this->index_file.size();
-  this->index_file.seekp(20, std::ios::beg);
-  for (int i = 3; i >= 0; i--)
-    this->index_file << static_cast<char>(((dirm_off - 24) >> (8 * i)) & 0xFF);
-  dirm_off += dirm_off & 1;
-  if (!bare && this->outline_stream.get())
-  {
-    TemporaryFile bzz_file;
-    this->index_file.seekp(dirm_off, std::ios::beg);
-    index_file.write("NAVM\0\0\0", 8);
-    bzz_file << this->outline_stream->str();
-    bzz_file.close();
-    DjVuCommand bzz("bzz");
-    bzz << "-e" << bzz_file << "-";
-    bzz(index_file);
-    std::streamoff outline_off = index_file.size();
-    this->index_file.seekp(dirm_off + 4, std::ios::beg);
-    for (int i = 3; i >= 0; i--)
-      this->index_file << static_cast<char>(((outline_off - dirm_off - 8) >> (8 * i)) & 0xFF);
-  }
-  std::streamoff off = this->index_file.size();
-  this->index_file.seekp(8, std::ios::beg);
-  for (int i = 3; i >= 0; i--)
-    this->index_file << static_cast<char>(((off - 12) >> (8 * i)) & 0xFF);
+  this->index_file << "AT&TFORM";
+  print_int(this->index_file, offset - 12, 4);
+  this->index_file << "DJVMDIRM";
+  print_int(this->index_file, dirm_size, 4);
+  this->index_file << '\1';
+  print_int(this->index_file, size + this->needs_shared_ant, 2);
+  this->index_file << dirm_bzz;
+  if (dirm_size & 1)
+    this->index_file << '\0';
+  this->index_file << navm;
   this->index_file.close();
+  this->index_size = offset;
 }
 
 static int calculate_dpi(const pdf::dpi::Guess &guess)
@@ -1166,15 +1626,33 @@ static int calculate_dpi(const pdf::dpi::Guess &guess)
     return static_cast<int>(dpi);
 }
 
-static int calculate_dpi(pdf::Document &doc, int n, bool crop)
+static int calculate_dpi(double page_width, double page_height)
 {
-  double page_width, page_height;
-  doc.get_page_size(n, crop, page_width, page_height);
-  if (config.guess_dpi)
+  if (config.preferred_page_size.first)
   {
-    pdf::dpi::Guesser dpi_guesser(doc);
-    try
-    {
+    double hdpi = config.preferred_page_size.first / page_width;
+    double vdpi = config.preferred_page_size.second / page_height;
+    double dpi = std::min(hdpi, vdpi) + 0.5;
+    if (dpi < djvu::min_dpi)
+      return djvu::min_dpi;
+    else if (dpi > djvu::max_dpi)
+      return djvu::max_dpi;
+    else
+      return static_cast<int>(dpi);
+  }
+  else
+    return config.dpi;
+}
+
+static int calculate_dpi(pdf::Document &doc, int n, bool crop)
+{
+  double page_width, page_height;
+  doc.get_page_size(n, crop, page_width, page_height);
+  if (config.guess_dpi)
+  {
+    pdf::dpi::Guesser dpi_guesser(doc);
+    try
+    {
       pdf::dpi::Guess guess = dpi_guesser[n];
       std::ostringstream guess_str;
       guess_str << guess;
@@ -1188,25 +1666,12 @@ static int calculate_dpi(pdf::Document &doc, int n, bool crop)
       debug(2) << _("unable to guess resolution") << std::endl;
     }
   }
+  int dpi = calculate_dpi(page_width, page_height);
   if (config.preferred_page_size.first)
-  {
-    double hdpi = config.preferred_page_size.first / page_width;
-    double vdpi = config.preferred_page_size.second / page_height;
-    double dpi = std::min(hdpi, vdpi) + 0.5;
-    int int_dpi;
-    if (dpi < djvu::min_dpi)
-      int_dpi = djvu::min_dpi;
-    else if (dpi > djvu::max_dpi)
-      int_dpi = djvu::max_dpi;
-    else
-      int_dpi = static_cast<int>(dpi);
     debug(2)
-      << string_printf(_("estimated resolution: %d dpi"), int_dpi)
+      << string_printf(_("estimated resolution: %d dpi"), dpi)
       << std::endl;
-    return int_dpi;
-  }
-  else
-    return config.dpi;
+  return dpi;
 }
 
 class StdoutIsATerminal : public std::runtime_error
@@ -1244,6 +1709,669 @@ static void calculate_subsampled_size(int width, int height, int ratio, int &sub
   }
 }
 
+static std::string downsample_background(pdf::Renderer *renderer, int sub_width, int sub_height)
+/* Compute the subsampled background image by averaging blocks of pixels of
+ * the full-resolution RGB bitmap, without taking it from the renderer.
+ * Return raw data of the P6 image.
+ *
+ * The block size is ceil(width / sub_width), which is the ratio the decoder
+ * uses for upsampling. Blocks at the right and bottom edges may be smaller.
+ */
+{
+  pdf::splash::Bitmap *bmp = renderer->get_bitmap();
+  int width = bmp->getWidth();
+  int height = bmp->getHeight();
+  assert(bmp->getMode() == splashModeRGB8);
+  int hratio = (width + sub_width - 1) / sub_width;
+  int vratio = (height + sub_height - 1) / sub_height;
+  const uint8_t *data = bmp->getDataPtr();
+  size_t row_size = bmp->getRowSize();
+  size_t byte_width = 3 * static_cast<size_t>(width);
+  std::vector<uint32_t> sums(byte_width);
+  std::string result(3 * static_cast<size_t>(sub_width) * sub_height, '\0');
+  char *out = &result[0];
+  for (int sy = 0; sy < sub_height; sy++)
+  {
+    int y0 = sy * vratio;
+    int y1 = std::min(y0 + vratio, height);
+    std::fill(sums.begin(), sums.end(), 0);
+    uint32_t *sums_ptr = sums.data();
+    for (int y = y0; y < y1; y++)
+    {
+      /* This loop is kept trivial so that the compiler can vectorize it. */
+      const uint8_t *row = data + y * row_size;
+      for (size_t i = 0; i < byte_width; i++)
+        sums_ptr[i] += row[i];
+    }
+    for (int sx = 0; sx < sub_width; sx++)
+    {
+      int x0 = sx * hratio;
+      int x1 = std::min(x0 + hratio, width);
+      uint32_t n = (x1 - x0) * (y1 - y0);
+      uint32_t r = 0, g = 0, b = 0;
+      for (int x = x0; x < x1; x++)
+      {
+        r += sums_ptr[3 * x];
+        g += sums_ptr[3 * x + 1];
+        b += sums_ptr[3 * x + 2];
+      }
+      *out++ = (r + n / 2) / n;
+      *out++ = (g + n / 2) / n;
+      *out++ = (b + n / 2) / n;
+    }
+  }
+  return result;
+}
+
+static std::ostream &encode_page(DjVuCommand &csepdjvu, const File &output_file, int dpi)
+/* Start encoding one or more pages with the same resolution.
+ * The separation data should be written to the returned stream, which is
+ * connected to the encoder through a pipe; then csepdjvu.wait() should be
+ * called.
+ *
+ * libdjvulibre exposes only the decoder (ddjvuapi) and the miniexp API;
+ * the JB2, IW44 and BZZ encoders are not part of its public interface,
+ * so encoding is delegated to ``csepdjvu``.
+ */
+{
+  csepdjvu << "-d" << dpi;
+  if (config.bg_slices)
+    csepdjvu << "-q" << config.bg_slices;
+  if (config.text == config.TEXT_LINES)
+    csepdjvu << "-t";
+  csepdjvu << "-" << output_file;
+  return csepdjvu.spawn(); // csepdjvu -d <dpi> [-q <slices>] [-t] - <output-djvu-file> < <sep-data>
+}
+
+/* Multi-threading would interact badly with logging. Disable it for now.
+ * The pool size counts both the rendering and the encoding threads. */
+#define debug(x) if (ThreadPool::get_size() == 1) (debug)(x)
+
+/* Serializes logging and updates of the output document between threads: */
+static std::mutex output_mutex;
+
+static std::string encode_jb2(pdf::Renderer *renderer, int width, int height)
+/* Encode the bitmap with ``cjb2`` for lossy compression.
+ * Return data of the resulting Sjbz chunk.
+ */
+{
+  TemporaryFile pbm_file, cjb2_file;
+  debug(3) << _("encoding monochrome image with `cjb2`") << std::endl;
+  DjVuCommand cjb2("cjb2");
+  cjb2 << "-losslevel" << config.loss_level << pbm_file << cjb2_file;
+  pbm_file << "P4 " << width << " " << height << std::endl;
+  pdf::Pixmap bmp(renderer);
+  pbm_file << bmp;
+  pbm_file.close();
+  cjb2_file.close();
+  cjb2();
+  djvu::Form cjb2_page;
+  cjb2_file.reopen();
+  cjb2_file >> cjb2_page;
+  cjb2_file.close();
+  const djvu::Chunk *sjbz = cjb2_page.find("Sjbz");
+  if (sjbz == nullptr)
+    throw djvu::IFFError();
+  return sjbz->data;
+}
+
+class PendingPage
+/* A page that was sent to the encoder, but is not finalized yet. */
+{
+public:
+  size_t index;
+  Component *component;
+  int width, height;
+  int background_color[3];
+  bool should_have_fgbz;
+  bool nonwhite_background_color;
+  bool need_reassemble;
+  std::string sjbz;
+  std::string annotations;
+  PendingPage(size_t index, Component &component)
+  : index(index),
+    component(&component),
+    width(0), height(0),
+    background_color{0xFF, 0xFF, 0xFF},
+    should_have_fgbz(false),
+    nonwhite_background_color(false),
+    need_reassemble(false)
+  { }
+  void finalize(djvu::Form &page, bool include_shared_ant) const;
+};
+
+void PendingPage::finalize(djvu::Form &page, bool include_shared_ant) const
+{
+  if (this->need_reassemble)
+  { /* Re-assemble the page, mangling chunks created by csepdjvu: */
+    debug(3) << _("re-assembling page") << std::endl;
+    if (config.monochrome)
+    {
+      page.replace(djvu::Chunk("Sjbz", this->sjbz));
+      page.remove("FGbz");
+      page.remove("BG44");
+    }
+    else if (!this->should_have_fgbz)
+    {
+      page.remove("FGbz");
+      page.remove("BG44");
+    }
+    else if (this->nonwhite_background_color)
+    {
+      TemporaryDirectory c44_dir;
+      TemporaryFile c44_file(c44_dir, "bg.djvu");
+      c44_file.close();
+      { /* Create solid-color PPM image with subsample ratio 12: */
+        TemporaryFile ppm_file;
+        debug(3) << _("creating new background image with `c44`") << std::endl;
+        DjVuCommand c44("c44");
+        c44 << "-slice" << "97" << ppm_file << c44_file;
+        int bg_width = (this->width + 11) / 12;
+        int bg_height = (this->height + 11) / 12;
+        ppm_file << "P6 " << bg_width << " " << bg_height << " 255" << std::endl;
+        for (int y = 0; y < bg_height; y++)
+        for (int x = 0; x < bg_width; x++)
+        for (int c : this->background_color)
+        {
+          char byte = c;
+          ppm_file.write(&byte, 1);
+        }
+        ppm_file.close();
+        c44();
+      }
+      { /* Replace previous (dummy) BG44 chunks with the newly created ones: */
+        djvu::Form c44_page;
+        c44_file.reopen();
+        c44_file >> c44_page;
+        c44_file.close();
+        page.remove("BG44");
+        for (const djvu::Chunk &chunk : c44_page.get_chunks())
+          if (chunk.id == "BG44")
+            page.insert_before("TXTz", chunk);
+      }
+    }
+  }
+  if (include_shared_ant)
+    page.insert_after("INFO", djvu::Chunk("INCL", djvu::shared_ant_file_name));
+  if (this->annotations.length() > 0)
+  { /* Add per-page non-raster data into the DjVu file: */
+    debug(3) << _("adding annotations") << std::endl;
+    page.append("ANTa", this->annotations);
+  }
+}
+
+class PageSink
+/* Destination for separation data of rendered pages. */
+{
+public:
+  virtual std::ostream &start_page(Component &component, int dpi) = 0;
+  virtual void end_page(const PendingPage &page) = 0;
+  virtual ~PageSink()
+  { }
+};
+
+class PageEncoder : public PageSink
+/* Encoder of a batch of pages with the same resolution.
+ *
+ * If the batch size is 1, ``csepdjvu`` writes directly to the page
+ * component. Otherwise, it creates a bundled document, which is then split
+ * into page components.
+ */
+{
+private:
+  PageEncoder(const PageEncoder&) = delete;
+  PageEncoder& operator=(const PageEncoder&) = delete;
+protected:
+  bool include_shared_ant;
+  DjVm &djvm;
+  intmax_t &djvu_pages_size;
+  std::unique_ptr<DjVuCommand> csepdjvu;
+  std::unique_ptr<TemporaryFile> output_file;
+  std::ostream *stream;
+  int dpi;
+  std::vector<PendingPage> pages;
+public:
+  PageEncoder(bool include_shared_ant, DjVm &djvm, intmax_t &djvu_pages_size)
+  : include_shared_ant(include_shared_ant),
+    djvm(djvm),
+    djvu_pages_size(djvu_pages_size),
+    stream(nullptr),
+    dpi(0)
+  { }
+  std::ostream &start_page(Component &component, int dpi);
+  void end_page(const PendingPage &page);
+  void finish();
+};
+
+std::ostream &PageEncoder::start_page(Component &component, int dpi)
+{
+  /* csepdjvu uses the same resolution for all the pages: */
+  if (this->csepdjvu.get() != nullptr && this->dpi != dpi)
+    this->finish();
+  if (this->csepdjvu.get() == nullptr)
+  {
+    this->csepdjvu.reset(new DjVuCommand("csepdjvu"));
+    this->dpi = dpi;
+    if (config.encoder_batch > 1)
+    {
+      this->output_file.reset(new TemporaryFile());
+      this->output_file->close();
+      this->stream = &encode_page(*this->csepdjvu, *this->output_file, dpi);
+    }
+    else
+      this->stream = &encode_page(*this->csepdjvu, component.get_file(), dpi);
+  }
+  return *this->stream;
+}
+
+void PageEncoder::end_page(const PendingPage &page)
+{
+  this->pages.push_back(page);
+  if (this->pages.size() >= static_cast<size_t>(config.encoder_batch))
+    this->finish();
+}
+
+void PageEncoder::finish()
+{
+  if (this->csepdjvu.get() == nullptr)
+    return;
+  debug(3) << _("encoding layers with `csepdjvu`") << std::endl;
+  this->csepdjvu->wait();
+  std::vector<djvu::Form> forms;
+  if (this->output_file.get() != nullptr)
+  {
+    djvu::Form document;
+    this->output_file->reopen();
+    *this->output_file >> document;
+    this->output_file->close();
+    if (document.get_type() == "DJVM")
+      forms = document.get_forms("DJVU");
+    else
+      forms.push_back(document);
+    if (forms.size() != this->pages.size())
+      throw djvu::IFFError();
+  }
+  for (size_t i = 0; i < this->pages.size(); i++)
+  {
+    const PendingPage &pending = this->pages[i];
+    Component &component = *pending.component;
+    const bool need_rewrite =
+      !forms.empty() ||
+      pending.need_reassemble ||
+      pending.annotations.length() > 0 ||
+      this->include_shared_ant;
+    if (need_rewrite)
+    {
+      djvu::Form page;
+      if (forms.empty())
+        component.read(page);
+      else
+        page = forms[i];
+      pending.finalize(page, this->include_shared_ant);
+      component.write(page);
+    }
+    {
+      size_t page_size = component.size();
+      debug(2)
+        << string_printf(ngettext("%zu bytes out", "%zu bytes out", page_size), page_size)
+        << std::endl;
+      this->djvu_pages_size += page_size;
+    }
+    this->djvm.complete(pending.index);
+  }
+  this->pages.clear();
+  this->stream = nullptr;
+  this->output_file.reset(nullptr);
+  this->csepdjvu.reset(nullptr);
+}
+
+class RenderedPage
+/* A page that was rendered, but not sent to the encoder yet. */
+{
+public:
+  Component &component;
+  int dpi;
+  std::string sep_data;
+  PendingPage pending;
+  RenderedPage(Component &component, int dpi, const std::string &sep_data, const PendingPage &pending)
+  : component(component),
+    dpi(dpi),
+    sep_data(sep_data),
+    pending(pending)
+  { }
+};
+
+class PageQueue
+/* Bounded queue of pages waiting for encoding threads.
+ *
+ * Rendering threads wait when the queue is full,
+ * so that only a limited number of rendered pages is kept in memory.
+ */
+{
+private:
+  PageQueue(const PageQueue&) = delete;
+  PageQueue& operator=(const PageQueue&) = delete;
+protected:
+  std::mutex mutex;
+  std::condition_variable not_empty, not_full;
+  std::deque<std::unique_ptr<RenderedPage>> pages;
+  size_t capacity;
+  int n_producers;
+public:
+  explicit PageQueue(size_t capacity)
+  : capacity(capacity),
+    n_producers(0)
+  { }
+  void set_n_producers(int n)
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->n_producers = n;
+  }
+  void push(std::unique_ptr<RenderedPage> page);
+  std::unique_ptr<RenderedPage> pop();
+  void close_producer();
+};
+
+void PageQueue::push(std::unique_ptr<RenderedPage> page)
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  while (this->pages.size() >= this->capacity)
+    this->not_full.wait(lock);
+  this->pages.push_back(std::move(page));
+  this->not_empty.notify_one();
+}
+
+std::unique_ptr<RenderedPage> PageQueue::pop()
+/* Return the oldest page in the queue.
+ * Return null pointer if the queue is empty and all producers are done.
+ */
+{
+  std::unique_lock<std::mutex> lock(this->mutex);
+  while (this->pages.empty() && this->n_producers > 0)
+    this->not_empty.wait(lock);
+  std::unique_ptr<RenderedPage> page;
+  if (!this->pages.empty())
+  {
+    page = std::move(this->pages.front());
+    this->pages.pop_front();
+    this->not_full.notify_one();
+  }
+  return page;
+}
+
+void PageQueue::close_producer()
+{
+  std::lock_guard<std::mutex> lock(this->mutex);
+  assert(this->n_producers > 0);
+  if (--this->n_producers == 0)
+    this->not_empty.notify_all();
+}
+
+class QueuedPageSink : public PageSink
+/* Collect separation data of a page in memory,
+ * then pass the page to the encoding threads.
+ */
+{
+protected:
+  PageQueue &queue;
+  Component *component;
+  int dpi;
+  std::ostringstream stream;
+public:
+  explicit QueuedPageSink(PageQueue &queue)
+  : queue(queue),
+    component(nullptr),
+    dpi(0)
+  { }
+  std::ostream &start_page(Component &component, int dpi)
+  {
+    this->component = &component;
+    this->dpi = dpi;
+    this->stream.str("");
+    return this->stream;
+  }
+  void end_page(const PendingPage &page)
+  {
+    assert(this->component != nullptr);
+    std::unique_ptr<RenderedPage> rendered(
+      new RenderedPage(*this->component, this->dpi, this->stream.str(), page)
+    );
+    this->stream.str("");
+    this->component = nullptr;
+    this->queue.push(std::move(rendered));
+  }
+};
+
+#undef debug
+
+template <typename F>
+static void run_in_thread(F f)
+/* The exception handlers duplicate the ones in main(), for the sake of threads.
+ * They should be kept in sync.
+ */
+{
+  try
+  {
+    f();
+  }
+  catch (const std::ios_base::failure &ex)
+  {
+    error_log << string_printf(_("Input/output error (%s)"), ex.what()) << std::endl;
+    exit(2);
+  }
+  catch (const std::runtime_error &ex)
+  {
+    error_log << ex << std::endl;
+    exit(1);
+  }
+}
+
+class OpenDocument
+/* A PDF document, together with renderers that were started on it. */
+{
+private:
+  OpenDocument(const OpenDocument&) = delete;
+  OpenDocument& operator=(const OpenDocument&) = delete;
+public:
+  const char *path;
+  std::unique_ptr<pdf::Document> doc;
+  std::unique_ptr<MainRenderer> out1;
+  std::unique_ptr<MutedRenderer> outm, outs;
+  OpenDocument(const char *path, pdf::splash::Color &paper_color, const ComponentList &page_files, RecordFilter *text_filter);
+};
+
+OpenDocument::OpenDocument(const char *path, pdf::splash::Color &paper_color, const ComponentList &page_files, RecordFilter *text_filter)
+: path(path),
+  doc(new pdf::Document(path))
+{
+  this->out1.reset(new MainRenderer(paper_color, config.monochrome));
+  this->out1->start_doc(this->doc.get());
+  this->outm.reset(new MutedRenderer(paper_color, config.monochrome, page_files, text_filter));
+  this->outm->start_doc(this->doc.get());
+  if (!config.monochrome)
+  {
+    this->outs.reset(new MutedRenderer(paper_color, config.monochrome, page_files, text_filter));
+    this->outs->start_doc(this->doc.get());
+  }
+}
+
+class DocumentCache
+/* Per-thread cache of the most recently used documents.
+ *
+ * Switching back to a document that is still in the cache doesn't require
+ * parsing it and loading its fonts again.
+ */
+{
+private:
+  DocumentCache(const DocumentCache&) = delete;
+  DocumentCache& operator=(const DocumentCache&) = delete;
+protected:
+  static const size_t capacity = 4;
+  pdf::splash::Color &paper_color;
+  const ComponentList &page_files;
+  RecordFilter *text_filter;
+  /* most recently used first: */
+  std::list<std::unique_ptr<OpenDocument>> documents;
+public:
+  DocumentCache(pdf::splash::Color &paper_color, const ComponentList &page_files, RecordFilter *text_filter)
+  : paper_color(paper_color),
+    page_files(page_files),
+    text_filter(text_filter)
+  { }
+  OpenDocument &get(const char *path);
+};
+
+OpenDocument &DocumentCache::get(const char *path)
+{
+  for (auto it = this->documents.begin(); it != this->documents.end(); it++)
+    if ((*it)->path == path)
+    {
+      this->documents.splice(this->documents.begin(), this->documents, it);
+      return *this->documents.front();
+    }
+  std::unique_ptr<OpenDocument> document(new OpenDocument(path, this->paper_color, this->page_files, this->text_filter));
+  if (this->documents.size() >= capacity)
+    this->documents.pop_back();
+  this->documents.push_front(std::move(document));
+  return *this->documents.front();
+}
+
+static double estimate_page_cost(pdf::Document &doc, int n, bool crop)
+/* Estimate how expensive it is to convert the page.
+ * Only relative values matter; the weights are rough. The estimate must be
+ * much cheaper than the conversion itself, so the page is not interpreted,
+ * and the resolution is not guessed.
+ */
+{
+  /* Interpreting a byte of a content stream costs roughly as much as
+   * rasterizing and encoding this many pixels: */
+  const double contents_weight = 64.0;
+  double page_width, page_height;
+  doc.get_page_size(n, crop, page_width, page_height);
+  int dpi = calculate_dpi(page_width, page_height);
+  double page_pixels = page_width * dpi * page_height * dpi;
+  return page_pixels + contents_weight * doc.get_contents_size(n);
+}
+
+static std::vector<double> estimate_page_costs(pdf::DocumentMap &document_map, const std::vector<int> &page_numbers, bool crop, int n_threads)
+{
+  std::vector<double> costs(page_numbers.size());
+  ThreadPool::run(n_threads, [&](int thread, int n_running) {
+    std::unique_ptr<pdf::Document> doc;
+    const char *doc_filename = nullptr;
+    /* Each thread takes a contiguous range of pages: */
+    size_t begin = page_numbers.size() * thread / n_running;
+    size_t end = page_numbers.size() * (thread + 1) / n_running;
+    for (size_t i = begin; i < end; i++)
+      run_in_thread([&] {
+        pdf::PageInfo pi = document_map.get(page_numbers[i]);
+        if (pi.path != doc_filename)
+        {
+          doc_filename = pi.path;
+          doc.reset(new pdf::Document(doc_filename));
+        }
+        costs[i] = estimate_page_cost(*doc, pi.local_pageno, crop);
+      });
+  });
+  return costs;
+}
+
+class PageScheduler
+/* Distribute pages between threads.
+ *
+ * Pages are split into contiguous chunks of similar estimated cost, and
+ * every thread gets a contiguous range of chunks, so that it keeps working on
+ * the same document. Each thread processes its chunks most expensive first.
+ * A thread that runs out of work steals the most expensive chunk of the
+ * thread that has the most work left.
+ */
+{
+private:
+  PageScheduler(const PageScheduler&) = delete;
+  PageScheduler& operator=(const PageScheduler&) = delete;
+protected:
+  class Chunk
+  {
+  public:
+    size_t begin, end;
+    double cost;
+    Chunk(size_t begin, size_t end, double cost)
+    : begin(begin), end(end), cost(cost)
+    { }
+    bool operator<(const Chunk &other) const
+    {
+      /* most expensive first: */
+      return this->cost > other.cost;
+    }
+  };
+  std::mutex mutex;
+  std::vector<std::deque<Chunk>> chunks;
+  std::vector<double> remaining_cost;
+  std::vector<std::pair<size_t, size_t>> current;
+public:
+  PageScheduler(const std::vector<double> &costs, int n_threads);
+  bool next(int thread, size_t &index);
+};
+
+PageScheduler::PageScheduler(const std::vector<double> &costs, int n_threads)
+: chunks(n_threads),
+  remaining_cost(n_threads, 0.0),
+  current(n_threads, std::make_pair(0, 0))
+{
+  assert(n_threads > 0);
+  double total_cost = 0.0;
+  for (double cost : costs)
+    total_cost += cost;
+  /* Several chunks per thread leave room for balancing: */
+  double chunk_cost = total_cost / (4 * n_threads);
+  double done_cost = 0.0;
+  size_t begin = 0;
+  double cost = 0.0;
+  for (size_t i = 0; i < costs.size(); i++)
+  {
+    cost += costs[i];
+    bool last = i + 1 == costs.size();
+    if (!last && cost + costs[i + 1] <= chunk_cost)
+      continue;
+    /* Assign the chunk to the thread whose share contains its midpoint: */
+    double midpoint = done_cost + cost / 2;
+    int thread = total_cost > 0 ? static_cast<int>(midpoint / total_cost * n_threads) : 0;
+    thread = std::min(thread, n_threads - 1);
+    this->chunks[thread].push_back(Chunk(begin, i + 1, cost));
+    this->remaining_cost[thread] += cost;
+    done_cost += cost;
+    begin = i + 1;
+    cost = 0.0;
+  }
+  for (std::deque<Chunk> &thread_chunks : this->chunks)
+    std::stable_sort(thread_chunks.begin(), thread_chunks.end());
+}
+
+bool PageScheduler::next(int thread, size_t &index)
+/* Pick the next page for the thread.
+ * Return false if there are no pages left.
+ */
+{
+  std::lock_guard<std::mutex> lock(this->mutex);
+  std::pair<size_t, size_t> &current = this->current.at(thread);
+  if (current.first == current.second)
+  {
+    int victim = thread;
+    if (this->chunks[thread].empty())
+      for (size_t i = 0; i < this->chunks.size(); i++)
+        if (!this->chunks[i].empty() && (victim == thread || this->remaining_cost[i] > this->remaining_cost[victim]))
+          victim = i;
+    if (this->chunks[victim].empty())
+      return false;
+    const Chunk &chunk = this->chunks[victim].front();
+    current = std::make_pair(chunk.begin, chunk.end);
+    this->remaining_cost[victim] -= chunk.cost;
+    this->chunks[victim].pop_front();
+  }
+  index = current.first++;
+  return true;
+}
+
 static int xmain(int argc, char * const argv[])
 {
   std::ios_base::sync_with_stdio(false);
@@ -1270,6 +2398,10 @@ static int xmain(int argc, char * const argv[])
     exit(1);
   }
 
+  if (config.spawn_helper)
+    Command::start_helper();
+  TemporaryFile::set_memory_budget(static_cast<size_t>(config.temporary_memory) << 20);
+
   if (config.output_stdout)
   {
     if (isatty(std::cout))
@@ -1293,6 +2425,7 @@ static int xmain(int argc, char * const argv[])
   std::vector<int> page_numbers;
   std::unique_ptr<const Directory> output_dir;
   std::unique_ptr<File> output_file;
+  std::unique_ptr<RawOutput> bundle_output;
   /* `page_files` has to be declared before `djvm`;
    * otherwise temporary files could be removed in the wrong order:
    * https://github.com/jwilk/pdf2djvu/issues/114
@@ -1319,25 +2452,18 @@ static int xmain(int argc, char * const argv[])
       quantizer.reset(new GraphicsMagickQuantizer(config));
     }
 
-#if _OPENMP
-  if (config.n_jobs >= 1)
-    omp_set_num_threads(config.n_jobs);
-#else
-  if (config.n_jobs != 1)
-  {
-    debug(1) << string_printf(_("Warning: %s"), _("pdf2djvu was built without OpenMP support; multi-threading is disabled.")) << std::endl;
-    config.n_jobs = 1;
-  }
-#endif
+  if (config.n_jobs < 1)
+    config.n_jobs = ThreadPool::get_default_size();
 
   if (config.format == config.FORMAT_BUNDLED)
   {
     if (config.output_stdout)
-      output_file.reset(new TemporaryFile());
+      bundle_output.reset(new RawOutput(std::cout));
     else
-      output_file.reset(new File(config.output));
-    page_files.reset(new TemporaryComponentList(n_pages, page_map));
-    djvm.reset(new BundledDjVm(*output_file));
+      bundle_output.reset(new RawOutput(config.output));
+    TemporaryComponentList *temporary_page_files = new TemporaryComponentList(n_pages, page_map);
+    page_files.reset(temporary_page_files);
+    djvm.reset(new BundledDjVm(*bundle_output, temporary_page_files->get_shared_ant()));
   }
   else
   {
@@ -1415,360 +2541,333 @@ static int xmain(int argc, char * const argv[])
   if (page_numbers.size() == 0)
     throw Config::NoPagesSelected();
 
-  std::unique_ptr<MainRenderer> out1;
-  std::unique_ptr<MutedRenderer> outm, outs;
-  std::unique_ptr<pdf::Document> doc;
-  const char *doc_filename = nullptr;
+  bool include_shared_ant = false;
+  if (config.extract_metadata)
+  {
+    /* Only first PDF document metadata is taken into account. */
+    pdf::Document doc(config.filenames[0]);
+    pdf::Metadata metadata(doc);
+    std::ostringstream annotations;
+    debug(3) << _("extracting XMP metadata") << std::endl;
+    {
+      std::string xmp_bytes = doc.get_xmp();
+      debug(0)++;
+      if (config.adjust_metadata)
+        try
+        {
+          xmp_bytes = xmp::transform(xmp_bytes, metadata);
+        }
+        catch (const xmp::Error &ex)
+        {
+          debug(1) << string_printf(_("Warning: %s"), ex.what()) << std::endl;
+        }
+      debug(0)--;
+      if (xmp_bytes.length())
+      {
+        static sexpr::Ref xmp_symbol = sexpr::symbol("xmp");
+        sexpr::Ref xmp = sexpr::nil;
+        xmp = sexpr::cons(sexpr::string(xmp_bytes), xmp);
+        xmp = sexpr::cons(xmp_symbol, xmp);
+        annotations << xmp << std::endl;
+      }
+    }
+    debug(3) << _("extracting document-information metadata") << std::endl;
+    pdf_metadata_to_djvu_metadata(metadata, annotations);
+    /* Store metadata in the shared annotation file, which is then included
+     * by every page: */
+    djvu::Form shared_ant("DJVI");
+    if (annotations.str().length() > 0)
+      shared_ant.append("ANTa", annotations.str());
+    page_files->write_shared_ant(shared_ant);
+    djvm->require_shared_ant();
+    include_shared_ant = true;
+  }
+
+  if (config.extract_outline)
+  {
+    /* Only first PDF document outline is taken into account. */
+    pdf::Document doc(config.filenames[0]);
+    debug(3) << _("extracting document outline") << std::endl;
+    pdf_outline_to_djvu_outline(doc, djvu_outline, *page_files);
+    djvm->set_outline(djvu_outline);
+  }
+  /* From now on, pages can be written out as soon as they are encoded: */
+  djvm->begin();
 
   bool crop = !config.use_media_box;
 
+  /* With --encode-jobs, pages are rendered and encoded by separate threads: */
+  int n_threads = config.n_jobs;
+  int n_render_jobs = 0;
+  if (config.encode_jobs > 0)
+  {
+    n_render_jobs = config.render_jobs > 0 ? config.render_jobs : n_threads;
+    n_threads = n_render_jobs + config.encode_jobs;
+  }
+  PageQueue page_queue(config.encode_jobs);
+  std::vector<double> page_costs(page_numbers.size(), 1.0);
+  int n_estimate_threads = n_render_jobs > 0 ? n_render_jobs : n_threads;
+  if (n_estimate_threads > 1)
+  {
+    /* Estimate costs of pages, so that expensive ones can be started first: */
+    page_costs = estimate_page_costs(document_map, page_numbers, crop, n_estimate_threads);
+  }
+  std::unique_ptr<PageScheduler> scheduler;
+  std::once_flag scheduler_flag;
+
 #ifdef USE_HEAP_PROFILING
   HeapProfilerStart(config.output.c_str());
 #endif
   debug(0)++;
-  #pragma omp parallel for private(out1, outm, outs, doc) firstprivate(doc_filename) reduction(+: djvu_pages_size) schedule(runtime)
-  for (size_t i = 0; i < page_numbers.size(); i++)
-  try
-  {
-    int n = page_numbers[i];
-#if USE_HEAP_PROFILING
+  ThreadPool::run(n_threads, [&](int thread, int n_running) {
+    intmax_t thread_pages_size = 0;
+    intmax_t thread_pixels = 0;
+    /* One persistent text filter per thread, shared by all its renderers: */
+    std::unique_ptr<RecordFilter> text_filter;
+    if (config.text_filter_persistent)
+      text_filter.reset(new RecordFilter(config.text_filter_command_line));
+    DocumentCache documents(paper_color, *page_files, text_filter.get());
+    const char *doc_filename = nullptr;
+    auto render_page = [&](size_t i, PageSink &sink)
     {
-      std::string reason = string_printf("before page #%d", n);
-      HeapProfilerDump(reason.c_str());
-    }
+      int n = page_numbers[i];
+#if USE_HEAP_PROFILING
+      {
+        std::string reason = string_printf("before page #%d", n);
+        HeapProfilerDump(reason.c_str());
+      }
 #endif
-    pdf::PageInfo pi = document_map.get(n);
-    const char * new_filename = pi.path;
-    int m = pi.local_pageno;
-    if (new_filename != doc_filename)
-    {
-      doc_filename = new_filename;
-      doc.reset(new pdf::Document(doc_filename));
-      #pragma omp critical
+      pdf::PageInfo pi = document_map.get(n);
+      const char * new_filename = pi.path;
+      int m = pi.local_pageno;
+      OpenDocument &document = documents.get(new_filename);
+      std::unique_ptr<pdf::Document> &doc = document.doc;
+      std::unique_ptr<MainRenderer> &out1 = document.out1;
+      std::unique_ptr<MutedRenderer> &outm = document.outm;
+      std::unique_ptr<MutedRenderer> &outs = document.outs;
+      if (new_filename != doc_filename)
       {
+        doc_filename = new_filename;
+        std::lock_guard<std::mutex> lock(output_mutex);
         debug(0)--;
         debug(1) << pdf::get_c_string(doc->getFileName()) << ":" << std::endl;
         debug(0)++;
       }
-      out1.reset(new MainRenderer(paper_color, config.monochrome));
-      out1->start_doc(doc.get());
-      outm.reset(new MutedRenderer(paper_color, config.monochrome, *page_files));
-      outm->start_doc(doc.get());
+      assert(doc.get() != nullptr);
+      assert(out1.get() != nullptr);
+      assert(outm.get() != nullptr);
       if (!config.monochrome)
+        assert(outs.get() != nullptr);
+      Component &component = (*page_files)[n];
       {
-        outs.reset(new MutedRenderer(paper_color, config.monochrome, *page_files));
-        outs->start_doc(doc.get());
+        std::lock_guard<std::mutex> lock(output_mutex);
+        debug(1) << string_printf(_("page #%d -> #%d"), n, page_map.get(n));
+        debug(1) << std::endl;
       }
-    }
-    assert(doc.get() != nullptr);
-    assert(out1.get() != nullptr);
-    assert(outm.get() != nullptr);
-    if (!config.monochrome)
-      assert(outs.get() != nullptr);
-    Component &component = (*page_files)[n];
-    #pragma omp critical
-    {
-      debug(1) << string_printf(_("page #%d -> #%d"), n, page_map.get(n));
-      debug(1) << std::endl;
-    }
-#if _OPENMP
 /* Multi-threading would interact badly with logging. Disable it for now. */
-#define debug(x) if (config.n_jobs == 1) (debug)(x)
-#endif
-    debug(0)++;
-    debug(3) << _("rendering page (1st pass)") << std::endl;
-    double page_width, page_height;
-    doc->get_page_size(m, crop, page_width, page_height);
-    int dpi = calculate_dpi(*doc, m, crop);
-    doc->display_page(outm.get(), m, dpi, dpi, crop, true);
-    int width = outm->getBitmapWidth();
-    int height = outm->getBitmapHeight();
-    if (width == 1 && height == 1 && page_width * dpi >= 2)
-    {
-      /* When the Splash backend runs out of memory,
-       * it produces a 1x1 bitmap without signalling an error in any way
-       * (other than printing “Out of memory” on stderr).
-       * https://github.com/jwilk/pdf2djvu/issues/107
-       */
-      errno = ENOMEM;
-      throw_posix_error("");
-    }
-    n_pixels += width * height;
-    debug(2) << string_printf(_("image size: %dx%d"), width, height) << std::endl;
-    if (!config.no_render && outm->has_skipped_elements())
-    { /* Render the page second time, without skipping any elements. */
-      debug(3) << _("rendering page (2nd pass)") << std::endl;
-      doc->display_page(out1.get(), m, dpi, dpi, crop, false);
-      if (out1->getBitmapWidth() != width || out1->getBitmapHeight() != height)
+#define debug(x) if (ThreadPool::get_size() == 1) (debug)(x)
+      debug(0)++;
+      debug(3) << _("rendering page (1st pass)") << std::endl;
+      double page_width, page_height;
+      doc->get_page_size(m, crop, page_width, page_height);
+      int dpi = calculate_dpi(*doc, m, crop);
+      doc->display_page(outm.get(), m, dpi, dpi, crop, true);
+      int width = outm->getBitmapWidth();
+      int height = outm->getBitmapHeight();
+      if (width == 1 && height == 1 && page_width * dpi >= 2)
       {
+        /* When the Splash backend runs out of memory,
+         * it produces a 1x1 bitmap without signalling an error in any way
+         * (other than printing “Out of memory” on stderr).
+         * https://github.com/jwilk/pdf2djvu/issues/107
+         */
         errno = ENOMEM;
         throw_posix_error("");
       }
-    }
-    debug(3) << _("preparing data for `csepdjvu`") << std::endl;
-    debug(0)++;
-    TemporaryFile sep_file;
-    debug(3) << _("storing foreground image") << std::endl;
-    bool has_background = false;
-    int background_color[3];
-    bool has_foreground = false;
-    bool has_text = false;
-    (*quantizer)(
-        outm->has_skipped_elements()
-        ? static_cast<pdf::Renderer*>(out1.get())
-        : static_cast<pdf::Renderer*>(outm.get()),
-        outm.get(),
-        width, height,
-        background_color, has_foreground, has_background,
-        sep_file
-    );
-    bool nonwhite_background_color;
-    if (has_background)
-    {
-      /* The image has a real (non-solid) background. Store subsampled IW44 image. */
+      thread_pixels += width * height;
+      debug(2) << string_printf(_("image size: %dx%d"), width, height) << std::endl;
+      if (!config.no_render && outm->has_skipped_elements())
+      {
+        if (outm->composite_text(out1.get()))
+        {
+          debug(3) << _("compositing text onto the foreground image") << std::endl;
+        }
+        else
+        { /* Render the page second time, without skipping any elements. */
+          debug(3) << _("rendering page (2nd pass)") << std::endl;
+          doc->display_page(out1.get(), m, dpi, dpi, crop, false);
+          if (out1->getBitmapWidth() != width || out1->getBitmapHeight() != height)
+          {
+            errno = ENOMEM;
+            throw_posix_error("");
+          }
+        }
+      }
+      debug(3) << _("preparing data for `csepdjvu`") << std::endl;
+      debug(0)++;
+      std::ostream &sep_stream = sink.start_page(component, dpi);
+      debug(3) << _("storing foreground image") << std::endl;
+      bool has_background = false;
+      int background_color[3];
+      bool has_foreground = false;
       int sub_width, sub_height;
       calculate_subsampled_size(width, height, config.bg_subsample, sub_width, sub_height);
-      double hdpi = sub_width / page_width;
-      double vdpi = sub_height / page_height;
-      debug(3) << _("rendering background image") << std::endl;
-      doc->display_page(outs.get(), m, hdpi, vdpi, crop, true);
-      if (sub_width != outs->getBitmapWidth())
-        throw std::logic_error(_("Unexpected subsampled bitmap width"));
-      if (sub_height != outs->getBitmapHeight())
-        throw std::logic_error(_("Unexpected subsampled bitmap height"));
-      pdf::Pixmap bmp(outs.get());
-      debug(3) << _("storing background image") << std::endl;
-      sep_file << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
-      sep_file << bmp;
-      nonwhite_background_color = false;
-      outs->clear();
-    }
-    else
-    {
-      /* Background is solid. */
-      nonwhite_background_color = (background_color[0] & background_color[1] & background_color[2] & 0xFF) != 0xFF;
-      if (nonwhite_background_color)
-      { /* Create a dummy background, just to assure existence of FGbz chunks.
-         * The background chunk will be replaced later: */
-        int sub_width, sub_height;
-        calculate_subsampled_size(width, height, 12, sub_width, sub_height);
-        debug(3) << _("storing dummy background image") << std::endl;
-        sep_file << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
-        for (int x = 0; x < sub_width; x++)
-        for (int y = 0; y < sub_height; y++)
-          sep_file.write("\xFF\xFF\xFF", 3);
-      }
-    }
-    if (config.text)
-    {
-      debug(3) << _("storing text layer") << std::endl;
-      const std::string &texts = outm->get_texts();
-      sep_file << texts;
-      has_text = texts.length() > 0;
-      outm->clear_texts();
-    }
-    sep_file.close();
-    debug(0)--;
-    {
-      debug(3) << _("encoding layers with `csepdjvu`") << std::endl;
-      DjVuCommand csepdjvu("csepdjvu");
-      csepdjvu << "-d" << dpi;
-      if (config.bg_slices)
-        csepdjvu << "-q" << config.bg_slices;
-      if (config.text == config.TEXT_LINES)
-        csepdjvu << "-t";
-      csepdjvu << sep_file << component;
-      csepdjvu();
-    }
-    const bool should_have_fgbz = has_background || has_foreground || nonwhite_background_color;
-    const bool need_reassemble =
-      config.no_render
-      ? false
-      : (config.monochrome || nonwhite_background_color || !should_have_fgbz);
-    TemporaryFile sed_file;
-    if (need_reassemble)
-    {
-      TemporaryFile sjbz_file, fgbz_file, bg44_file;
-      if (!config.monochrome)
-      { /* Extract FGbz and BG44 image chunks, to that they can be mangled and
-         * re-assembled later: */
-        debug(3) << _("recovering images with `djvuextract`") << std::endl;
-        DjVuCommand djvuextract("djvuextract");
-        djvuextract << component;
-        if (should_have_fgbz)
-          djvuextract
-            << std::string("FGbz=") + std::string(fgbz_file)
-            << std::string("BG44=") + std::string(bg44_file);
-        djvuextract << std::string("Sjbz=") + std::string(sjbz_file);
-        djvuextract(config.verbose < 3);
-      }
-      if (config.monochrome)
-      { /* Use cjb2 for lossy compression: */
-        TemporaryFile pbm_file;
-        debug(3) << _("encoding monochrome image with `cjb2`") << std::endl;
-        DjVuCommand cjb2("cjb2");
-        cjb2 << "-losslevel" << config.loss_level << pbm_file << sjbz_file;
-        pbm_file << "P4 " << width << " " << height << std::endl;
-        pdf::Pixmap bmp(
+      /* The background might be computed from the full-resolution bitmap,
+       * so the quantizer must not take it away: */
+      const bool bg_downsample = config.bg_downsample && !config.monochrome;
+      outm->keep_bitmap(bg_downsample);
+      (*quantizer)(
           outm->has_skipped_elements()
           ? static_cast<pdf::Renderer*>(out1.get())
-          : static_cast<pdf::Renderer*>(outm.get())
-        );
-        pbm_file << bmp;
-        pbm_file.close();
-        cjb2();
-      }
-      else if (nonwhite_background_color)
+          : static_cast<pdf::Renderer*>(outm.get()),
+          outm.get(),
+          width, height,
+          outm->get_dirty_region(),
+          background_color, has_foreground, has_background,
+          sep_stream
+      );
+      bool nonwhite_background_color;
+      if (has_background)
       {
-        TemporaryDirectory c44_dir;
-        TemporaryFile c44_file(c44_dir, "bg.djvu");
-        c44_file.close();
-        { /* Create solid-color PPM image with subsample ratio 12: */
-          TemporaryFile ppm_file;
-          debug(3) << _("creating new background image with `c44`") << std::endl;
-          DjVuCommand c44("c44");
-          c44 << "-slice" << "97" << ppm_file << c44_file;
-          int bg_width = (width + 11) / 12;
-          int bg_height = (height + 11) / 12;
-          ppm_file << "P6 " << bg_width << " " << bg_height << " 255" << std::endl;
-          for (int y = 0; y < bg_height; y++)
-          for (int x = 0; x < bg_width; x++)
-          for (char c : background_color)
-          {
-            ppm_file.write(&c, 1);
-          }
-          ppm_file.close();
-          c44();
+        /* The image has a real (non-solid) background. Store subsampled IW44 image. */
+        if (bg_downsample)
+        {
+          debug(3) << _("downsampling background image") << std::endl;
+          std::string background = downsample_background(outm.get(), sub_width, sub_height);
+          debug(3) << _("storing background image") << std::endl;
+          sep_stream << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
+          sep_stream << background;
         }
-        { /* Replace previous (dummy) BG44 chunk with the newly created one: */
-          debug(3) << _("recovering image chunks with `djvuextract`") << std::endl;
-          DjVuCommand djvuextract("djvuextract");
-          djvuextract << c44_file << std::string("BG44=") + std::string(bg44_file);
-          djvuextract(config.verbose < 3);
+        else
+        {
+          double hdpi = sub_width / page_width;
+          double vdpi = sub_height / page_height;
+          debug(3) << _("rendering background image") << std::endl;
+          doc->display_page(outs.get(), m, hdpi, vdpi, crop, true);
+          if (sub_width != outs->getBitmapWidth())
+            throw std::logic_error(_("Unexpected subsampled bitmap width"));
+          if (sub_height != outs->getBitmapHeight())
+            throw std::logic_error(_("Unexpected subsampled bitmap height"));
+          pdf::Pixmap bmp(outs.get());
+          debug(3) << _("storing background image") << std::endl;
+          sep_stream << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
+          sep_stream << bmp;
+          outs->clear();
         }
+        nonwhite_background_color = false;
       }
-      if (has_text)
-      { /* Extract hidden text layer (as created by csepdjvu); save it into the sed file: */
-        debug(3) << _("recovering text with `djvused`") << std::endl;
-        DjVuCommand djvused("djvused");
-        djvused << component << "-e" << "output-txt";
-        djvused(sed_file);
+      else
+      {
+        /* Background is solid. */
+        nonwhite_background_color = (background_color[0] & background_color[1] & background_color[2] & 0xFF) != 0xFF;
+        if (nonwhite_background_color)
+        { /* Create a dummy background, just to assure existence of FGbz chunks.
+           * The background chunk will be replaced later: */
+          int sub_width, sub_height;
+          calculate_subsampled_size(width, height, 12, sub_width, sub_height);
+          debug(3) << _("storing dummy background image") << std::endl;
+          sep_stream << "P6 " << sub_width << " " << sub_height << " 255" << std::endl;
+          for (int x = 0; x < sub_width; x++)
+          for (int y = 0; y < sub_height; y++)
+            sep_stream.write("\xFF\xFF\xFF", 3);
+        }
       }
-      { /* Re-assemble new DjVu using previously mangled chunks: */
-        debug(3) << _("re-assembling page with `djvumake`") << std::endl;
-        DjVuCommand djvumake("djvumake");
-        std::ostringstream info;
-        info << "INFO=" << width << "," << height << "," << dpi;
-        djvumake
-          << component
-          << info.str()
-          << std::string("Sjbz=") + std::string(sjbz_file);
-        if (should_have_fgbz && (fgbz_file.size() || bg44_file.size()))
-          djvumake
-            << std::string("FGbz=") + std::string(fgbz_file)
-            << std::string("BG44=") + std::string(bg44_file) + std::string(":99");
-        djvumake();
+      if (bg_downsample)
+      { /* Release the full-resolution bitmap, as the quantizer would have: */
+        outm->keep_bitmap(false);
+        delete outm->take_bitmap();
       }
+      if (config.text)
+      {
+        debug(3) << _("storing text layer") << std::endl;
+        const std::string &texts = outm->get_texts();
+        sep_stream << texts;
+        outm->clear_texts();
+      }
+      debug(0)--;
+      PendingPage pending(i, component);
+      pending.width = width;
+      pending.height = height;
+      std::copy(background_color, background_color + 3, pending.background_color);
+      pending.should_have_fgbz = has_background || has_foreground || nonwhite_background_color;
+      pending.nonwhite_background_color = nonwhite_background_color;
+      pending.need_reassemble =
+        config.no_render
+        ? false
+        : (config.monochrome || nonwhite_background_color || !pending.should_have_fgbz);
+      { /* Extract annotations (hyperlinks): */
+        sexpr::Guard guard;
+        debug(3) << _("extracting annotations") << std::endl;
+        std::ostringstream stream;
+        for (const sexpr::Ref &annotation : outm->get_annotations())
+          stream << annotation << std::endl;
+        pending.annotations = stream.str();
+        outm->clear_annotations();
+      }
+      if (pending.need_reassemble && config.monochrome)
+      { /* Use cjb2 for lossy compression: */
+        pending.sjbz = encode_jb2(
+          outm->has_skipped_elements()
+          ? static_cast<pdf::Renderer*>(out1.get())
+          : static_cast<pdf::Renderer*>(outm.get()),
+          width, height
+        );
+      }
+      outm->clear();
+      sink.end_page(pending);
+      debug(0)--;
+#undef debug
+    };
+    /* The thread pool might provide fewer threads than requested.
+     * Keep at least one of them for encoding.
+     */
+    int n_renderers = n_running;
+    bool pipeline = n_render_jobs > 0 && n_running > 1;
+    if (pipeline)
+      n_renderers = std::min(n_render_jobs, n_running - 1);
+    std::call_once(scheduler_flag, [&] {
+      if (pipeline)
+        page_queue.set_n_producers(n_renderers);
+      scheduler.reset(new PageScheduler(page_costs, n_renderers));
+    });
+    size_t i;
+    if (!pipeline)
+    {
+      PageEncoder encoder(include_shared_ant, *djvm, thread_pages_size);
+      while (scheduler->next(thread, i))
+        run_in_thread([&] { render_page(i, encoder); });
+      /* Encode pages that are still pending: */
+      run_in_thread([&] { encoder.finish(); });
     }
-    { /* Extract annotations (hyperlinks); save it into the sed file: */
-      sexpr::Guard guard;
-      debug(3) << _("extracting annotations") << std::endl;
-      const std::vector<sexpr::Ref> &annotations = outm->get_annotations();
-      sed_file << "select 1" << std::endl << "set-ant" << std::endl;
-      for (const sexpr::Ref &annotation : annotations)
-        sed_file << annotation << std::endl;
-      sed_file << "." << std::endl;
-      outm->clear_annotations();
-    }
-    outm->clear();
-    sed_file.close();
-    { /* Add per-page non-raster data into the DjVu file: */
-      debug(3) << _("adding non-raster data with `djvused`") << std::endl;
-      DjVuCommand djvused("djvused");
-      djvused << component << "-s" << "-f" << sed_file;
-      djvused();
-    }
+    else if (thread < n_renderers)
     {
-      size_t page_size = component.size();
-      debug(2)
-        << string_printf(ngettext("%zu bytes out", "%zu bytes out", page_size), page_size)
-        << std::endl;
-      djvu_pages_size += page_size;
+      QueuedPageSink sink(page_queue);
+      while (scheduler->next(thread, i))
+        run_in_thread([&] { render_page(i, sink); });
+      page_queue.close_producer();
     }
-    debug(0)--;
-#if _OPENMP
-#undef debug
-#endif
-  }
-  /* These exception handlers duplicate the ones in main(), for the sake of OMP.
-   * They should be kept in sync.
-   */
-  catch (const std::ios_base::failure &ex)
-  {
-    error_log << string_printf(_("Input/output error (%s)"), ex.what()) << std::endl;
-    exit(2);
-  }
-  catch (const std::runtime_error &ex)
-  {
-    error_log << ex << std::endl;
-    exit(1);
-  }
-  catch (...)
-  {
-    throw;
-  }
-#ifdef USE_HEAP_PROFILING
-  HeapProfilerDump("after last page");
-#endif
-  /* Only first PDF document metadata/outline is taken into account. */
-  doc.reset(new pdf::Document(config.filenames[0]));
-  if (config.extract_metadata)
-  {
-    TemporaryFile sed_file;
-    pdf::Metadata metadata(*doc);
-    debug(3) << _("extracting XMP metadata") << std::endl;
+    else
     {
-      std::string xmp_bytes = doc->get_xmp();
-      debug(0)++;
-      if (config.adjust_metadata)
-        try
+      PageEncoder encoder(include_shared_ant, *djvm, thread_pages_size);
+      run_in_thread([&] {
+        while (std::unique_ptr<RenderedPage> page = page_queue.pop())
         {
-          xmp_bytes = xmp::transform(xmp_bytes, metadata);
+          encoder.start_page(page->component, page->dpi) << page->sep_data;
+          encoder.end_page(page->pending);
         }
-        catch (const xmp::Error &ex)
-        {
-          debug(1) << string_printf(_("Warning: %s"), ex.what()) << std::endl;
-        }
-      debug(0)--;
-      if (xmp_bytes.length())
-      {
-        static sexpr::Ref xmp_symbol = sexpr::symbol("xmp");
-        sexpr::Ref xmp = sexpr::nil;
-        xmp = sexpr::cons(sexpr::string(xmp_bytes), xmp);
-        xmp = sexpr::cons(xmp_symbol, xmp);
-        sed_file
-          << "create-shared-ant" << std::endl
-          << "set-ant" << std::endl
-          << xmp << std::endl
-          << "." << std::endl;
-      }
+        encoder.finish();
+      });
     }
-    debug(3) << _("extracting document-information metadata") << std::endl;
-    sed_file << "set-meta" << std::endl;
-    pdf_metadata_to_djvu_metadata(metadata, sed_file);
-    sed_file << "." << std::endl;
-    sed_file.close();
-    djvm->set_metadata(sed_file);
-  }
-  if (config.extract_outline)
-  {
-    debug(3) << _("extracting document outline") << std::endl;
-    pdf_outline_to_djvu_outline(*doc, djvu_outline, *page_files);
-    djvm->set_outline(djvu_outline);
-  }
+    std::lock_guard<std::mutex> lock(output_mutex);
+    djvu_pages_size += thread_pages_size;
+    n_pixels += thread_pixels;
+  });
+#ifdef USE_HEAP_PROFILING
+  HeapProfilerDump("after last page");
+#endif
   djvm->commit();
   {
-    size_t djvu_size = output_file->size();
+    size_t djvu_size = djvm->size();
     if (config.format == config.FORMAT_INDIRECT)
     {
       djvu_size += djvu_pages_size;
@@ -1799,8 +2898,6 @@ static int xmain(int argc, char * const argv[])
          )
       << std::endl;
   }
-  if (config.output_stdout)
-    copy_stream(*output_file, std::cout, true);
 #if USE_HEAP_PROFILING
   HeapProfilerDump("before exit");
   HeapProfilerStop();
@@ -229,6 +229,37 @@ void pdf::Document::get_page_size(int n, bool crop, double &width, double &heigh
     std::swap(width, height);
 }
 
+static size_t get_stream_length(pdf::Object &stream)
+{
+  pdf::Object length;
+  pdf::dict_lookup(stream.streamGetDict(), "Length", &length);
+  if (length.isInt() && length.getInt() > 0)
+    return length.getInt();
+  return 0;
+}
+
+size_t pdf::Document::get_contents_size(int n)
+/* Return the total length of the page content streams.
+ * This is a cheap estimate of how complex the page is.
+ */
+{
+  ::Page *page = this->getPage(n);
+  if (page == nullptr)
+    return 0;
+  pdf::Object contents = page->getContents();
+  size_t size = 0;
+  if (contents.isStream())
+    size = get_stream_length(contents);
+  else if (contents.isArray())
+    for (int i = 0; i < contents.arrayGetLength(); i++)
+    {
+      pdf::Object stream = contents.arrayGet(i);
+      if (stream.isStream())
+        size += get_stream_length(stream);
+    }
+  return size;
+}
+
 const std::string pdf::Document::get_xmp()
 {
   std::unique_ptr<const pdf::String> mstring;
@@ -471,7 +502,8 @@ bool pdf::Environment::antialias = false;
 
 pdf::Renderer::Renderer(pdf::splash::Color &paper_color, bool monochrome)
 : pdf::splash::OutputDevice(monochrome ? splashModeMono1 : splashModeRGB8, 4, false, paper_color),
-  catalog(NULL)
+  catalog(NULL),
+  bitmap_kept(false)
 {
   this->setFontAntialias(pdf::Environment::antialias);
   this->setVectorAntialias(pdf::Environment::antialias);
@@ -494,14 +526,17 @@ void pdf::Renderer::drawLink(pdf::link::Link *link, pdf::Catalog *catalog)
  */
 
 bool pdf::get_glyph(splash::Splash *splash, splash::Font *font,
-  double x, double y, int code, splash::GlyphBitmap *bitmap)
+  double x, double y, int code, splash::GlyphBitmap *bitmap,
+  splash::ClipResult *clip_result)
 {
   if (font == nullptr)
     return false;
-  splash::ClipResult clip_result;
-  if (!font->getGlyph(code, 0, 0, bitmap, static_cast<int>(x), static_cast<int>(y), splash->getClip(), &clip_result))
+  splash::ClipResult local_clip_result;
+  if (clip_result == nullptr)
+    clip_result = &local_clip_result;
+  if (!font->getGlyph(code, 0, 0, bitmap, static_cast<int>(x), static_cast<int>(y), splash->getClip(), clip_result))
     return false;
-  return (clip_result != splashClipAllOutside);
+  return (*clip_result != splashClipAllOutside);
 }
 
 
@@ -20,6 +20,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <ctime>
+#include <memory>
 #include <ostream>
 #include <stdexcept>
 #include <string>
@@ -83,6 +84,7 @@ namespace pdf
   typedef ::GooString String;
   typedef ::Goffset Offset;
   typedef ::Ref Ref;
+  typedef ::XRef XRef;
 
 /* type definitions — annotations
  * ==============================
@@ -145,8 +147,39 @@ namespace pdf
       this->startDoc(doc);
       this->catalog = doc->getCatalog();
     }
+    /* Provide the bitmap to be returned by take_bitmap() instead of the
+     * rendered one. The renderer takes ownership of it.
+     */
+    void set_bitmap(pdf::splash::Bitmap *bitmap)
+    {
+      this->replacement_bitmap.reset(bitmap);
+    }
+    pdf::splash::Bitmap *take_bitmap()
+    {
+      if (this->replacement_bitmap)
+        return this->replacement_bitmap.release();
+      return this->takeBitmap();
+    }
+    pdf::splash::Bitmap *get_bitmap()
+    {
+      if (this->replacement_bitmap)
+        return this->replacement_bitmap.get();
+      return this->getBitmap();
+    }
+    /* Let Pixmap only borrow the bitmap, so that it's still available
+     * afterwards: */
+    void keep_bitmap(bool value)
+    {
+      this->bitmap_kept = value;
+    }
+    bool is_bitmap_kept() const
+    {
+      return this->bitmap_kept;
+    }
   protected:
     pdf::Catalog *catalog;
+    std::unique_ptr<pdf::splash::Bitmap> replacement_bitmap;
+    bool bitmap_kept;
     static void convert_path(gfx::State *state, pdf::splash::Path &splash_path);
   };
 
@@ -198,6 +231,7 @@ namespace pdf
   protected:
     const uint8_t *raw_data;
     pdf::splash::Bitmap *bmp;
+    bool owned;
     size_t row_size;
     size_t byte_width;
     bool monochrome;
@@ -216,7 +250,8 @@ namespace pdf
 
     explicit Pixmap(Renderer *renderer)
     {
-      bmp = renderer->takeBitmap();
+      owned = !renderer->is_bitmap_kept();
+      bmp = owned ? renderer->take_bitmap() : renderer->get_bitmap();
       raw_data = const_cast<const uint8_t*>(bmp->getDataPtr());
       width = bmp->getWidth();
       height = bmp->getHeight();
@@ -251,7 +286,8 @@ namespace pdf
 
     ~Pixmap()
     {
-      delete bmp;
+      if (owned)
+        delete bmp;
     }
 
     PixmapIterator begin() const
@@ -259,6 +295,11 @@ namespace pdf
       return PixmapIterator(raw_data, row_size);
     }
 
+    const uint8_t *get_row(int y) const
+    {
+      return raw_data + y * row_size;
+    }
+
     friend std::ostream &operator<<(std::ostream &, const Pixmap &);
   };
 
@@ -293,6 +334,7 @@ namespace pdf
     explicit Document(const std::string &file_name);
     void display_page(Renderer *renderer, int npage, double hdpi, double vdpi, bool crop, bool do_links);
     void get_page_size(int n, bool crop, double &width, double &height);
+    size_t get_contents_size(int n);
     const std::string get_xmp();
     void get_doc_info(pdf::Object &info)
     {
@@ -400,6 +442,11 @@ namespace pdf
     {
       return ::dblToCol(x);
     }
+
+    static inline uint8_t color_component_as_byte(pdf::gfx::ColorComponent c)
+    {
+      return ::colToByte(c);
+    }
   }
 
 /* glyph-related functions
@@ -408,7 +455,8 @@ namespace pdf
 
   bool get_glyph(pdf::splash::Splash *splash, pdf::splash::Font *font,
     double x, double y, // x, y are transformed (i.e. output device) coordinates
-    int code, pdf::splash::GlyphBitmap *bitmap);
+    int code, pdf::splash::GlyphBitmap *bitmap,
+    pdf::splash::ClipResult *clip_result = nullptr);
 
 /* dictionary lookup
  * =================
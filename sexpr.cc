@@ -15,6 +15,7 @@
 #include "sexpr.hh"
 
 #include <cstdio>
+#include <mutex>
 
 #include <libdjvu/ddjvuapi.h>
 #include <libdjvu/miniexp.h>
@@ -39,43 +40,19 @@ namespace sexpr
     }
 }
 
-#if _OPENMP && DDJVUAPI_VERSION < 23
+#if DDJVUAPI_VERSION < 23
 
-#include <omp.h>
-
-class OmpLock
-{
-private:
-    omp_lock_t m_lock;
-public:
-    OmpLock()
-    {
-        omp_init_lock(&this->m_lock);
-    }
-    void lock()
-    {
-        omp_set_lock(&this->m_lock);
-    }
-    void unlock()
-    {
-        omp_unset_lock(&this->m_lock);
-    }
-    ~OmpLock()
-    {
-        omp_destroy_lock(&this->m_lock);
-    }
-};
-
-static OmpLock omp_lock;
+/* The minilisp memory manager is not thread-safe in older DjVuLibre. */
+static std::mutex minilisp_mutex;
 
 sexpr::Guard::Guard()
 {
-    omp_lock.lock();
+    minilisp_mutex.lock();
 }
 
 sexpr::Guard::~Guard()
 {
-    omp_lock.unlock();
+    minilisp_mutex.unlock();
 }
 
 #else
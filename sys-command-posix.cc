@@ -18,28 +18,42 @@
 #include "autoconf.hh"
 #include "system.hh"
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <csignal>
+#include <initializer_list>
+#include <memory>
 #include <sstream>
+#include <streambuf>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#if _OPENMP
-#include <omp.h>
+// posix_spawnp() is used only if it can close the inherited descriptors.
+// Descriptors opened through std::fstream don't have the close-on-exec flag,
+// so otherwise they would leak into the child.
+#if HAVE_POSIX_SPAWNP && HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+#define USE_POSIX_SPAWN 1
+#include <spawn.h>
+extern char **environ;
 #endif
 
 #include "string-printf.hh"
 #include "i18n.hh"
+#include "thread-pool.hh"
 
 Command::Command(const std::string& command) : command(command)
 {
@@ -69,11 +83,7 @@ static int get_max_fd()
 {
     int max_fd_per_thread = 16; // rough estimate
     int max_fd = 16;
-#if _OPENMP
-    max_fd += max_fd_per_thread * omp_get_num_threads();
-#else
-    max_fd += max_fd_per_thread;
-#endif
+    max_fd += max_fd_per_thread * ThreadPool::get_size();
     return max_fd;
 }
 
@@ -86,14 +96,24 @@ static void fd_close(int fd)
 
 static void mkfifo(int fd[2], int add_flags=0)
 {
+#if HAVE_PIPE2
+    // Set the close-on-exec flag atomically,
+    // so that the pipe doesn't leak into a child spawned by another thread.
+    int rc = pipe2(fd, O_CLOEXEC);
+    if (rc < 0)
+        throw_posix_error("pipe2()");
+#else
     int rc = pipe(fd);
     if (rc < 0)
         throw_posix_error("pipe()");
+#endif
     for (int i = 0; i < 2; i++) {
+#if !HAVE_PIPE2
         // file descriptor flags:
         int rc = fcntl(fd[i], F_SETFD, FD_CLOEXEC);
         if (rc < 0)
             throw_posix_error("fcntl(fd, F_SETFD, FD_CLOEXEC)");
+#endif
         // file status flags:
         int fd_add_flags = add_flags;
         if (i == 0)
@@ -110,8 +130,34 @@ static void mkfifo(int fd[2], int add_flags=0)
     }
 }
 
+static void enlarge_pipe(int fd)
+// Try to enlarge the pipe buffer, so that fewer context switches are needed
+// to transfer large amounts of data.
+{
+#ifdef F_SETPIPE_SZ
+    // 1 MiB is the default maximum size for unprivileged users on Linux.
+    fcntl(fd, F_SETPIPE_SZ, 1 << 20); // ignore errors
+#else
+    (void) fd;
+#endif
+}
+
 static int fd_close_range(int fd_from, int fd_to, int fd_except=-1)
+// Close file descriptors from fd_from to fd_to, except fd_except.
+// If close_range() is available, fd_to is only a fallback estimate;
+// all the file descriptors above fd_from are closed.
+// Only async-signal-safe functions can be used here.
 {
+#if HAVE_CLOSE_RANGE
+    int rc = 0;
+    if (fd_except > fd_from)
+        rc = close_range(fd_from, fd_except - 1, 0);
+    if (rc == 0)
+        rc = close_range(std::max(fd_from, fd_except + 1), ~0U, 0);
+    if (rc == 0 || errno != ENOSYS)
+        return rc;
+    // Fall back to closing file descriptors one by one.
+#endif
     for (int fd = fd_from; fd <= fd_to; fd++) {
         if (fd == fd_except)
             continue;
@@ -196,120 +242,548 @@ std::string Command::repr()
         );
 }
 
-void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
+static ssize_t write_nosigpipe(int fd, const char *buffer, size_t size)
+// Like write(), but fail with EPIPE instead of raising SIGPIPE
+// if the reading end of the pipe has been closed.
 {
-    int rc;
-    int max_fd = get_max_fd();
-    int stdout_pipe[2];
-    int stdin_pipe[2];
-    int error_pipe[2];
-    size_t argc = this->argv.size();
-    std::vector<const char *> c_argv(argc + 1);
-    for (size_t i = 0; i < argc; i++)
-        c_argv[i] = argv[i].c_str();
-    c_argv[argc] = nullptr;
-    assert(c_argv[0] != nullptr);
-    mkfifo(stdout_pipe);
-    mkfifo(stdin_pipe, O_NONBLOCK);
-    mkfifo(error_pipe);
-    pid_t pid = fork();
-    if (pid < 0)
-        throw_posix_error("fork()");
-    if (pid == 0) {
-        // The child:
-        // At this point, only async-signal-safe functions can be used.
-        // See the signal(7) manpage for the full list.
-        rc = dup2(stdin_pipe[0], STDIN_FILENO);
-        if (rc < 0) {
-            report_posix_error(error_pipe[1], "dup2()");
-            abort();
+    sigset_t sigpipe_mask, old_mask, pending;
+    sigemptyset(&sigpipe_mask);
+    sigaddset(&sigpipe_mask, SIGPIPE);
+    int rc = pthread_sigmask(SIG_BLOCK, &sigpipe_mask, &old_mask);
+    if (rc != 0) {
+        errno = rc;
+        throw_posix_error("pthread_sigmask()");
+    }
+    rc = sigpending(&pending);
+    if (rc < 0)
+        throw_posix_error("sigpending()");
+    bool was_pending = sigismember(&pending, SIGPIPE);
+    ssize_t nbytes = write(fd, buffer, size);
+    int write_errno = errno;
+    if (nbytes < 0 && write_errno == EPIPE && !was_pending) {
+        // Consume the signal that was just generated:
+        rc = sigpending(&pending);
+        if (rc == 0 && sigismember(&pending, SIGPIPE)) {
+            int sig;
+            sigwait(&sigpipe_mask, &sig);
         }
-        rc = dup2(stdout_pipe[1], STDOUT_FILENO);
-        if (rc < 0) {
-            report_posix_error(error_pipe[1], "dup2()");
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+    errno = write_errno;
+    return nbytes;
+}
+
+static void throw_exec_error(const std::string &repr)
+// Throw an exception for the command that couldn't be executed.
+// The reason is taken from errno.
+{
+    std::string child_error = POSIXError::error_message("");
+    std::string message = string_printf(
+        _("External command \"%s\" failed: %s"),
+        repr.c_str(),
+        child_error.c_str()
+    );
+    throw Command::CommandFailed(message);
+}
+
+static void exec_child(const char * const *c_argv, int stdin_fd, int stdout_fd, bool stderr_, int error_fd, int max_fd)
+// Set up the standard streams and execute the command
+// in a freshly forked child; never return.
+// At this point, only async-signal-safe functions can be used.
+// See the signal(7) manpage for the full list.
+{
+    int rc = dup2(stdin_fd, STDIN_FILENO);
+    if (rc < 0) {
+        report_posix_error(error_fd, "dup2()");
+        abort();
+    }
+    if (stdout_fd < 0 || !stderr_) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd < 0) {
+            report_posix_error(error_fd, "open()");
             abort();
         }
+        if (stdout_fd < 0)
+            stdout_fd = fd;
         if (!stderr_) {
-            int fd = open("/dev/null", O_WRONLY);
-            if (fd < 0) {
-                report_posix_error(error_pipe[1], "open()");
-                abort();
-            }
             rc = dup2(fd, STDERR_FILENO);
             if (rc < 0) {
-                report_posix_error(error_pipe[1], "dup2()");
+                report_posix_error(error_fd, "dup2()");
                 abort();
             }
         }
-        int rc = fd_close_range(STDERR_FILENO + 1, max_fd, error_pipe[1]);
+    }
+    rc = dup2(stdout_fd, STDOUT_FILENO);
+    if (rc < 0) {
+        report_posix_error(error_fd, "dup2()");
+        abort();
+    }
+    rc = fd_close_range(STDERR_FILENO + 1, max_fd, error_fd);
+    if (rc < 0) {
+        report_posix_error(error_fd, "close()");
+        abort();
+    }
+    execvp(c_argv[0],
+        const_cast<char * const *>(c_argv)
+    );
+    report_posix_error(error_fd, "\xFF");
+    abort();
+}
+
+class ChildProcess
+// A child process started either directly, or by the spawn helper.
+// In the latter case, the wait status is read from status_fd.
+{
+public:
+    pid_t pid;
+    int status_fd;
+    explicit ChildProcess(pid_t pid, int status_fd=-1)
+    : pid(pid),
+      status_fd(status_fd)
+    { }
+};
+
+// The spawn helper
+// ================
+//
+// The helper is forked early, while pdf2djvu is still small and
+// single-threaded. For each command, pdf2djvu creates a new socket pair and
+// sends one end to the helper over the control socket. The helper forks a
+// runner, which receives the command line and the file descriptors for the
+// standard streams and the error pipe, executes the command, waits for it,
+// and sends back the wait status.
+
+static int helper_fd = -1;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+class SocketGuard
+// Close the socket when leaving the scope, unless it was released.
+{
+private:
+    SocketGuard(const SocketGuard&) = delete;
+    SocketGuard& operator=(const SocketGuard&) = delete;
+    int fd;
+public:
+    explicit SocketGuard(int fd)
+    : fd(fd)
+    { }
+    int release()
+    {
+        int fd = this->fd;
+        this->fd = -1;
+        return fd;
+    }
+    ~SocketGuard()
+    {
+        if (this->fd >= 0)
+            close(this->fd);
+    }
+};
+
+class HelperRequest
+{
+public:
+    enum
+    {
+        HAVE_STDOUT = 1,
+        HAVE_STDERR = 2,
+    };
+    uint32_t flags;
+    uint32_t argv_size;
+};
+
+static ssize_t send_fds(int socket_fd, const void *data, size_t size, const int *fds, size_t n_fds)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<void *>(data);
+    iov.iov_len = size;
+    std::vector<char> control(CMSG_SPACE(n_fds * sizeof (int)));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof (int));
+    memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof (int));
+    ssize_t nbytes;
+    do
+        nbytes = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+    while (nbytes < 0 && errno == EINTR);
+    return nbytes;
+}
+
+static ssize_t recv_fds(int socket_fd, void *data, size_t size, int *fds, size_t &n_fds)
+// Receive data and up to n_fds file descriptors;
+// update n_fds to the number of file descriptors actually received.
+{
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+    char control[CMSG_SPACE(4 * sizeof (int))];
+    assert(n_fds <= 4);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    ssize_t nbytes;
+    do
+        nbytes = recvmsg(socket_fd, &msg, 0);
+    while (nbytes < 0 && errno == EINTR);
+    size_t max_fds = n_fds;
+    n_fds = 0;
+    if (nbytes < 0)
+        return nbytes;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        const unsigned char *cmsg_data = CMSG_DATA(cmsg);
+        size_t cmsg_n_fds = (cmsg->cmsg_len - (cmsg_data - reinterpret_cast<unsigned char *>(cmsg))) / sizeof (int);
+        for (size_t i = 0; i < cmsg_n_fds; i++) {
+            int fd;
+            memcpy(&fd, cmsg_data + i * sizeof fd, sizeof fd);
+            if (n_fds < max_fds)
+                fds[n_fds++] = fd;
+            else
+                close(fd);
+        }
+    }
+    return nbytes;
+}
+
+static bool read_exactly(int fd, void *data, size_t size)
+{
+    char *buffer = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t nbytes = read(fd, buffer, size);
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+        if (nbytes <= 0)
+            return false;
+        buffer += nbytes;
+        size -= nbytes;
+    }
+    return true;
+}
+
+static void helper_run(int request_fd)
+// Run a single command on behalf of pdf2djvu.
+{
+    HelperRequest request;
+    int fds[4];
+    size_t n_fds = 4;
+    ssize_t nbytes = recv_fds(request_fd, &request, sizeof request, fds, n_fds);
+    if (nbytes != sizeof request)
+        _exit(1);
+    size_t n_expected_fds = 2;
+    if (request.flags & HelperRequest::HAVE_STDOUT)
+        n_expected_fds++;
+    if (request.flags & HelperRequest::HAVE_STDERR)
+        n_expected_fds++;
+    if (n_fds != n_expected_fds)
+        _exit(1);
+    int stdin_fd = fds[0];
+    int error_fd = fds[1];
+    int stdout_fd = -1;
+    size_t i = 2;
+    if (request.flags & HelperRequest::HAVE_STDOUT)
+        stdout_fd = fds[i++];
+    bool stderr_ = false;
+    if (request.flags & HelperRequest::HAVE_STDERR) {
+        // The helper's own standard error is /dev/null;
+        // install the one of pdf2djvu instead:
+        int rc = dup2(fds[i++], STDERR_FILENO);
         if (rc < 0) {
-            report_posix_error(error_pipe[1], "close()");
-            abort();
+            report_posix_error(error_fd, "dup2()");
+            _exit(1);
         }
-        execvp(c_argv[0],
-            const_cast<char * const *>(c_argv.data())
-        );
-        report_posix_error(error_pipe[1], "\xFF");
-        abort();
+        stderr_ = true;
     }
-    // The parent:
-    fd_close(stdin_pipe[0]);
-    fd_close(stdout_pipe[1]);
-    fd_close(error_pipe[1]);
-    char buffer[BUFSIZ];
-    struct pollfd fds[2];
-    if (stdin_)
-        fds[0].fd = stdin_pipe[1];
-    else {
-        fds[0].fd = -1;
-        fd_close(stdin_pipe[1]);
+    std::string argv_data(request.argv_size, '\0');
+    if (!read_exactly(request_fd, &argv_data[0], argv_data.size()))
+        _exit(1);
+    std::vector<const char *> c_argv;
+    for (size_t pos = 0; pos < argv_data.size(); pos = argv_data.find('\0', pos) + 1)
+        c_argv.push_back(argv_data.c_str() + pos);
+    c_argv.push_back(nullptr);
+    if (c_argv[0] == nullptr || argv_data.back() != '\0')
+        _exit(1);
+    // The error pipe must be closed when the command is executed:
+    fcntl(error_fd, F_SETFD, FD_CLOEXEC);
+    int wait_status = 0;
+    int max_fd = std::max(get_max_fd(), request_fd);
+    pid_t pid = fork();
+    if (pid < 0)
+        report_posix_error(error_fd, "fork()");
+    else if (pid == 0) {
+        close(request_fd);
+        exec_child(c_argv.data(), stdin_fd, stdout_fd, stderr_, error_fd, max_fd);
     }
-    fds[0].events = POLLOUT;
-    fds[1].fd = stdout_pipe[0];
-    fds[1].events = POLLIN;
+    // Only the command should hold the pipes now:
+    for (size_t j = 0; j < n_fds; j++)
+        close(fds[j]);
+    if (pid > 0) {
+        while (waitpid(pid, &wait_status, 0) < 0)
+            if (errno != EINTR) {
+                wait_status = 0;
+                break;
+            }
+    }
+    nbytes = write(request_fd, &wait_status, sizeof wait_status);
+    _exit(nbytes == sizeof wait_status ? 0 : 1);
+}
+
+static void helper_main(int control_fd)
+// Main loop of the helper. Exit when pdf2djvu closes the control socket.
+{
+    // Don't keep the standard streams of pdf2djvu open;
+    // the commands get them explicitly from the requests.
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0)
+        for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++)
+            dup2(null_fd, fd);
+    // Reap runners automatically:
+    signal(SIGCHLD, SIG_IGN);
     while (1) {
-        rc = poll(fds, 2, -1);
+        char byte;
+        int request_fd;
+        size_t n_fds = 1;
+        ssize_t nbytes = recv_fds(control_fd, &byte, sizeof byte, &request_fd, n_fds);
+        if (nbytes <= 0)
+            _exit(0);
+        if (n_fds != 1)
+            continue;
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(control_fd);
+            signal(SIGCHLD, SIG_DFL);
+            helper_run(request_fd);
+        }
+        close(request_fd);
+    }
+}
+
+void Command::start_helper()
+{
+    if (helper_fd >= 0)
+        return;
+    int fds[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    if (rc < 0)
+        throw_posix_error("socketpair()");
+    rc = fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    if (rc < 0)
+        throw_posix_error("fcntl(fd, F_SETFD, FD_CLOEXEC)");
+    pid_t pid = fork();
+    if (pid < 0)
+        throw_posix_error("fork()");
+    if (pid == 0) {
+        close(fds[0]);
+        helper_main(fds[1]);
+    }
+    fd_close(fds[1]);
+    helper_fd = fds[0];
+}
+
+static ChildProcess helper_exec(const std::vector<std::string> &argv, int stdin_fd, int stdout_fd, bool stderr_, int error_fd)
+// Ask the helper to run the command.
+{
+    int fds[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    if (rc < 0)
+        throw_posix_error("socketpair()");
+    SocketGuard guard0(fds[0]);
+    SocketGuard guard1(fds[1]);
+    for (int fd : fds) {
+        rc = fcntl(fd, F_SETFD, FD_CLOEXEC);
         if (rc < 0)
-            throw_posix_error("poll()");
-        if (fds[0].revents) {
-            assert(stdin_);
-            std::streamsize rbytes = stdin_->readsome(buffer, sizeof buffer);
-            if (rbytes == 0) {
-                fd_close(stdin_pipe[1]);
-                fds[0].fd = -1;
-            } else {
-                ssize_t wbytes = write(stdin_pipe[1], buffer, rbytes);
-                if (wbytes < 0)
-                    throw_posix_error("write()");
-                stdin_->seekg(wbytes - rbytes, std::ios_base::cur);
-            }
+            throw_posix_error("fcntl(fd, F_SETFD, FD_CLOEXEC)");
+    }
+    // A one-byte message is never split,
+    // so that concurrent requests don't interleave:
+    ssize_t nbytes = send_fds(helper_fd, "", 1, &fds[1], 1);
+    if (nbytes < 0)
+        throw_posix_error("sendmsg()");
+    fd_close(guard1.release());
+    std::string argv_data;
+    for (const std::string &arg : argv) {
+        argv_data += arg;
+        argv_data += '\0';
+    }
+    HelperRequest request;
+    request.flags = 0;
+    request.argv_size = argv_data.size();
+    int request_fds[4] = {stdin_fd, error_fd};
+    size_t n_fds = 2;
+    if (stdout_fd >= 0) {
+        request.flags |= HelperRequest::HAVE_STDOUT;
+        request_fds[n_fds++] = stdout_fd;
+    }
+    if (stderr_) {
+        request.flags |= HelperRequest::HAVE_STDERR;
+        request_fds[n_fds++] = STDERR_FILENO;
+    }
+    nbytes = send_fds(fds[0], &request, sizeof request, request_fds, n_fds);
+    if (nbytes < 0)
+        throw_posix_error("sendmsg()");
+    if (static_cast<size_t>(nbytes) != sizeof request) {
+        errno = EIO;
+        throw_posix_error("sendmsg()");
+    }
+    const char *data = argv_data.data();
+    size_t size = argv_data.size();
+    while (size > 0) {
+        nbytes = send(fds[0], data, size, MSG_NOSIGNAL);
+        if (nbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_posix_error("send()");
         }
-        if (fds[1].revents) {
-            ssize_t nbytes = read(stdout_pipe[0], buffer, sizeof buffer);
-            if (nbytes < 0)
-                throw_posix_error("read()");
-            if (nbytes == 0)
-                break;
-            if (stdout_)
-                stdout_->write(buffer, nbytes);
+        data += nbytes;
+        size -= nbytes;
+    }
+    return ChildProcess(0, guard0.release());
+}
+
+#if USE_POSIX_SPAWN
+
+class SpawnFileActions
+{
+public:
+    posix_spawn_file_actions_t actions;
+    SpawnFileActions()
+    {
+        int rc = posix_spawn_file_actions_init(&this->actions);
+        if (rc != 0) {
+            errno = rc;
+            throw_posix_error("posix_spawn_file_actions_init()");
         }
     }
-    if (stdin_) {
-        std::streamsize rbytes = stdin_->readsome(buffer, 1);
-        if (rbytes > 0) {
-            // The child process terminated,
-            // even though it didn't receive the complete input.
-            errno = EPIPE;
-            throw_posix_error("write()");
+    void check(int rc)
+    {
+        if (rc != 0) {
+            errno = rc;
+            throw_posix_error("posix_spawn_file_actions_add*()");
         }
     }
-    fd_close(stdout_pipe[0]);
-    int wait_status;
-    pid = waitpid(pid, &wait_status, 0);
+    ~SpawnFileActions()
+    {
+        posix_spawn_file_actions_destroy(&this->actions);
+    }
+};
+
+#endif
+
+static ChildProcess fork_exec(const std::vector<std::string> &argv, int stdin_fd, int stdout_fd, bool stderr_, int error_fd, const std::string &repr)
+// Run the command with the given standard input and output.
+// If stdout_fd is negative, the standard output is discarded.
+// If stderr_ is false, the standard error is discarded, too.
+// Failures in the child are reported via error_fd.
+//
+// If the spawn helper is running, the command is run by the helper.
+// Otherwise, if posix_spawnp() is available, it is used instead of fork(),
+// so that the cost of starting the command doesn't grow
+// with the size of the address space;
+// in this case, failures are reported directly, and error_fd is unused.
+{
+    if (helper_fd >= 0)
+        return helper_exec(argv, stdin_fd, stdout_fd, stderr_, error_fd);
+    size_t argc = argv.size();
+    std::vector<const char *> c_argv(argc + 1);
+    for (size_t i = 0; i < argc; i++)
+        c_argv[i] = argv[i].c_str();
+    c_argv[argc] = nullptr;
+    assert(c_argv[0] != nullptr);
+#if USE_POSIX_SPAWN
+    (void) error_fd;
+    SpawnFileActions file_actions;
+    posix_spawn_file_actions_t *actions = &file_actions.actions;
+    file_actions.check(posix_spawn_file_actions_adddup2(actions, stdin_fd, STDIN_FILENO));
+    if (stdout_fd < 0)
+        file_actions.check(posix_spawn_file_actions_addopen(actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0));
+    else
+        file_actions.check(posix_spawn_file_actions_adddup2(actions, stdout_fd, STDOUT_FILENO));
+    if (!stderr_)
+        file_actions.check(posix_spawn_file_actions_addopen(actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0));
+    file_actions.check(posix_spawn_file_actions_addclosefrom_np(actions, STDERR_FILENO + 1));
+    pid_t pid;
+    int rc = posix_spawnp(&pid, c_argv[0], actions, nullptr,
+        const_cast<char * const *>(c_argv.data()),
+        environ
+    );
+    if (rc != 0) {
+        errno = rc;
+        throw_exec_error(repr);
+    }
+    return ChildProcess(pid);
+#else
+    (void) repr;
+    int max_fd = get_max_fd();
+    pid_t pid = fork();
     if (pid < 0)
-        throw_posix_error("waitpid()");
+        throw_posix_error("fork()");
+    if (pid == 0)
+        exec_child(c_argv.data(), stdin_fd, stdout_fd, stderr_, error_fd, max_fd);
+    // The parent:
+    return ChildProcess(pid);
+#endif
+}
+
+static void mkerrorpipe(int fd[2])
+// Create the pipe through which fork_exec() reports failures in the child.
+// With posix_spawnp(), it is needed only if the spawn helper is running;
+// otherwise, both ends are set to -1.
+{
+#if USE_POSIX_SPAWN
+    if (helper_fd < 0) {
+        fd[0] = fd[1] = -1;
+        return;
+    }
+#endif
+    mkfifo(fd);
+}
+
+static int wait_process(const ChildProcess &child)
+// Wait for the child to terminate, and return its wait status.
+// The status_fd file descriptor, if any, is closed.
+{
+    int wait_status;
+    if (child.status_fd >= 0) {
+        ssize_t nbytes = read(child.status_fd, &wait_status, sizeof wait_status);
+        int read_errno = errno;
+        ::close(child.status_fd); // ignore errors
+        errno = read_errno;
+        if (nbytes < 0)
+            throw_posix_error("read()");
+        if (static_cast<size_t>(nbytes) != sizeof wait_status) {
+            errno = EIO;
+            throw_posix_error("read()");
+        }
+    } else {
+        pid_t pid = waitpid(child.pid, &wait_status, 0);
+        if (pid < 0)
+            throw_posix_error("waitpid()");
+    }
+    return wait_status;
+}
+
+static void wait_child(const ChildProcess &child, int error_fd, const std::string &repr)
+// Wait for the child to terminate; throw an exception if it failed.
+// The error_fd file descriptor, if any, is closed.
+{
+    int wait_status = wait_process(child);
     int child_errno = 0;
-    ssize_t nbytes = read(error_pipe[0], &child_errno, sizeof child_errno);
+    ssize_t nbytes = 0;
+    if (error_fd >= 0)
+        nbytes = read(error_fd, &child_errno, sizeof child_errno);
     if (nbytes < 0)
         throw_posix_error("read()");
     if (nbytes > 0 && static_cast<size_t>(nbytes) < sizeof child_errno) {
@@ -319,35 +793,30 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
     if (child_errno > 0) {
         char child_error_reason[BUFSIZ];
         ssize_t nbytes = read(
-            error_pipe[0],
+            error_fd,
             child_error_reason,
             (sizeof child_error_reason) - 1
         );
         if (nbytes < 0)
             throw_posix_error("read()");
-        fd_close(error_pipe[0]);
+        fd_close(error_fd);
         child_error_reason[nbytes] = '\0';
         errno = child_errno;
         if (child_error_reason[0] != '\xFF')
             throw_posix_error(child_error_reason);
-        std::string child_error = POSIXError::error_message("");
-        std::string message = string_printf(
-            _("External command \"%s\" failed: %s"),
-            this->repr().c_str(),
-            child_error.c_str()
-        );
-        throw CommandFailed(message);
+        throw_exec_error(repr);
     }
-    fd_close(error_pipe[0]);
+    if (error_fd >= 0)
+        fd_close(error_fd);
     if (WIFEXITED(wait_status)) {
         unsigned long exit_status = WEXITSTATUS(wait_status);
         if (exit_status != 0) {
             std::string message = string_printf(
                 _("External command \"%s\" failed with exit status %lu"),
-                this->repr().c_str(),
+                repr.c_str(),
                 exit_status
             );
-            throw CommandFailed(message);
+            throw Command::CommandFailed(message);
         }
     } else if (WIFSIGNALED(wait_status)) {
         int sig = WTERMSIG(wait_status);
@@ -358,16 +827,16 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
                 // L10N: the latter argument is an untranslated signal name
                 // (such as "SIGSEGV")
                 _("External command \"%s\" was terminated by %s"),
-                this->repr().c_str(),
+                repr.c_str(),
                 signame
             );
         else
             message = string_printf(
                 _("External command \"%s\" was terminated by signal %d"),
-                this->repr().c_str(),
+                repr.c_str(),
                 sig
             );
-        throw CommandFailed(message);
+        throw Command::CommandFailed(message);
     } else {
         // should not happen
         errno = EINVAL;
@@ -375,6 +844,249 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
     }
 }
 
+void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
+{
+    int rc;
+    int stdout_pipe[2];
+    int stdin_pipe[2];
+    int error_pipe[2];
+    mkfifo(stdout_pipe);
+    mkfifo(stdin_pipe, O_NONBLOCK);
+    mkerrorpipe(error_pipe);
+    if (stdin_)
+        enlarge_pipe(stdin_pipe[1]);
+    if (stdout_)
+        enlarge_pipe(stdout_pipe[0]);
+    ChildProcess child(-1);
+    try {
+        child = fork_exec(this->argv, stdin_pipe[0], stdout_pipe[1], stderr_, error_pipe[1], this->repr());
+    } catch (...) {
+        for (int fd : {stdin_pipe[0], stdin_pipe[1], stdout_pipe[0], stdout_pipe[1], error_pipe[0], error_pipe[1]})
+            ::close(fd); // ignore errors
+        throw;
+    }
+    // The parent:
+    fd_close(stdin_pipe[0]);
+    fd_close(stdout_pipe[1]);
+    if (error_pipe[1] >= 0)
+        fd_close(error_pipe[1]);
+    // Data is copied in 64 KiB chunks. Input that was taken from the stream
+    // buffer, but not yet accepted by the pipe, is kept in input_buffer.
+    std::vector<char> input_buffer(stdin_ ? 1 << 16 : 0);
+    size_t input_begin = 0, input_end = 0;
+    std::vector<char> output_buffer(1 << 16);
+    struct pollfd fds[2];
+    if (stdin_)
+        fds[0].fd = stdin_pipe[1];
+    else {
+        fds[0].fd = -1;
+        fd_close(stdin_pipe[1]);
+    }
+    fds[0].events = POLLOUT;
+    fds[1].fd = stdout_pipe[0];
+    fds[1].events = POLLIN;
+    while (1) {
+        rc = poll(fds, 2, -1);
+        if (rc < 0)
+            throw_posix_error("poll()");
+        if (fds[0].revents) {
+            assert(stdin_);
+            if (input_begin == input_end) {
+                input_begin = 0;
+                input_end = stdin_->rdbuf()->sgetn(input_buffer.data(), input_buffer.size());
+            }
+            bool eof = (input_begin == input_end);
+            ssize_t wbytes = 0;
+            if (!eof) {
+                wbytes = write_nosigpipe(stdin_pipe[1], input_buffer.data() + input_begin, input_end - input_begin);
+                if (wbytes < 0 && errno != EPIPE)
+                    throw_posix_error("write()");
+                if (wbytes > 0)
+                    input_begin += wbytes;
+            }
+            if (eof || wbytes < 0) {
+                // Either there's no more input,
+                // or the child won't read it anyway.
+                fd_close(stdin_pipe[1]);
+                fds[0].fd = -1;
+            }
+        }
+        if (fds[1].revents) {
+            ssize_t nbytes = read(stdout_pipe[0], output_buffer.data(), output_buffer.size());
+            if (nbytes < 0)
+                throw_posix_error("read()");
+            if (nbytes == 0)
+                break;
+            if (stdout_)
+                stdout_->write(output_buffer.data(), nbytes);
+        }
+    }
+    if (stdin_) {
+        bool incomplete = (
+            input_begin < input_end ||
+            !std::istream::traits_type::eq_int_type(stdin_->rdbuf()->sgetc(), std::istream::traits_type::eof())
+        );
+        if (incomplete) {
+            // The child process terminated,
+            // even though it didn't receive the complete input.
+            errno = EPIPE;
+            throw_posix_error("write()");
+        }
+    }
+    fd_close(stdout_pipe[0]);
+    wait_child(child, error_pipe[0], this->repr());
+}
+
+class PipeBuffer : public std::streambuf
+// Output stream buffer that writes to a pipe.
+// If the reading end is closed, the data are silently discarded;
+// the caller is expected to check is_broken() afterwards.
+{
+protected:
+    int fd;
+    bool broken;
+    std::vector<char> buffer;
+    void flush()
+    {
+        const char *data = this->pbase();
+        size_t size = this->pptr() - this->pbase();
+        while (size > 0 && !this->broken) {
+            ssize_t nbytes = write_nosigpipe(this->fd, data, size);
+            if (nbytes < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EPIPE) {
+                    this->broken = true;
+                    break;
+                }
+                throw_posix_error("write()");
+            }
+            data += nbytes;
+            size -= nbytes;
+        }
+        this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+    }
+    virtual int_type overflow(int_type c)
+    {
+        this->flush();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *this->pptr() = traits_type::to_char_type(c);
+            this->pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    virtual int sync()
+    {
+        this->flush();
+        return 0;
+    }
+public:
+    explicit PipeBuffer(int fd)
+    : fd(fd),
+      broken(false),
+      buffer(1 << 16)
+    {
+        this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+    }
+    void close()
+    {
+        if (this->fd < 0)
+            return;
+        this->flush();
+        int fd = this->fd;
+        this->fd = -1;
+        fd_close(fd);
+    }
+    bool is_broken() const
+    {
+        return this->broken;
+    }
+    ~PipeBuffer()
+    {
+        if (this->fd >= 0)
+            ::close(this->fd); // ignore errors
+    }
+};
+
+class Command::Child
+{
+public:
+    ChildProcess process;
+    int error_fd;
+    PipeBuffer stdin_buffer;
+    std::ostream stdin_;
+    Child(const ChildProcess &process, int stdin_fd, int error_fd)
+    : process(process),
+      error_fd(error_fd),
+      stdin_buffer(stdin_fd),
+      stdin_(&stdin_buffer)
+    {
+        this->stdin_.exceptions(std::ios::badbit);
+    }
+    ~Child()
+    {
+        if (this->process.pid < 0)
+            return;
+        // Something went wrong before wait() was called.
+        // Let the child see EOF, and then reap it.
+        try {
+            this->stdin_buffer.close();
+        } catch (const OSError &) {
+            // ignore errors
+        }
+        try {
+            wait_process(this->process);
+        } catch (const OSError &) {
+            // ignore errors
+        }
+        if (this->error_fd >= 0)
+            ::close(this->error_fd); // ignore errors
+    }
+};
+
+Command::~Command()
+{ }
+
+std::ostream &Command::spawn(bool quiet)
+{
+    assert(this->child == nullptr);
+    int stdin_pipe[2];
+    int error_pipe[2];
+    mkfifo(stdin_pipe);
+    mkerrorpipe(error_pipe);
+    enlarge_pipe(stdin_pipe[1]);
+    ChildProcess process(-1);
+    try {
+        process = fork_exec(this->argv, stdin_pipe[0], -1, !quiet, error_pipe[1], this->repr());
+    } catch (...) {
+        for (int fd : {stdin_pipe[0], stdin_pipe[1], error_pipe[0], error_pipe[1]})
+            ::close(fd); // ignore errors
+        throw;
+    }
+    // The parent:
+    fd_close(stdin_pipe[0]);
+    if (error_pipe[1] >= 0)
+        fd_close(error_pipe[1]);
+    this->child.reset(new Child(process, stdin_pipe[1], error_pipe[0]));
+    return this->child->stdin_;
+}
+
+void Command::wait()
+{
+    assert(this->child != nullptr);
+    std::unique_ptr<Child> child(std::move(this->child));
+    child->stdin_buffer.close();
+    ChildProcess process = child->process;
+    child->process.pid = -1;
+    wait_child(process, child->error_fd, this->repr());
+    if (child->stdin_buffer.is_broken()) {
+        // The child process terminated,
+        // even though it didn't receive the complete input.
+        errno = EPIPE;
+        throw_posix_error("write()");
+    }
+}
+
 std::string Command::filter(const std::string &command_line, const std::string &string)
 {
     std::istringstream stdin_(string);
@@ -385,6 +1097,160 @@ std::string Command::filter(const std::string &command_line, const std::string &
     return stdout_.str();
 }
 
+class RecordFilter::Process
+{
+public:
+    ChildProcess child;
+    int stdin_fd;
+    int stdout_fd;
+    int error_fd;
+    std::string output; // read, but not yet returned
+    Process()
+    : child(-1),
+      stdin_fd(-1),
+      stdout_fd(-1),
+      error_fd(-1)
+    { }
+    void close_pipes()
+    {
+        for (int *fd : {&this->stdin_fd, &this->stdout_fd}) {
+            if (*fd >= 0)
+                ::close(*fd); // ignore errors
+            *fd = -1;
+        }
+    }
+    ~Process()
+    {
+        // Let the command see EOF, and then reap it.
+        this->close_pipes();
+        if (this->child.pid >= 0) {
+            try {
+                wait_process(this->child);
+            } catch (const OSError &) {
+                // ignore errors
+            }
+        }
+        if (this->error_fd >= 0)
+            ::close(this->error_fd); // ignore errors
+    }
+};
+
+RecordFilter::RecordFilter(const std::string &command_line)
+: command_line(command_line)
+{ }
+
+RecordFilter::~RecordFilter()
+{ }
+
+void RecordFilter::start()
+{
+    std::vector<std::string> argv{"sh", "-c", this->command_line};
+    int stdin_pipe[2];
+    int stdout_pipe[2];
+    int error_pipe[2];
+    mkfifo(stdin_pipe, O_NONBLOCK);
+    mkfifo(stdout_pipe);
+    mkerrorpipe(error_pipe);
+    enlarge_pipe(stdin_pipe[1]);
+    enlarge_pipe(stdout_pipe[0]);
+    std::unique_ptr<Process> process(new Process);
+    try {
+        process->child = fork_exec(argv, stdin_pipe[0], stdout_pipe[1], true, error_pipe[1], this->command_line);
+    } catch (...) {
+        for (int fd : {stdin_pipe[0], stdin_pipe[1], stdout_pipe[0], stdout_pipe[1], error_pipe[0], error_pipe[1]})
+            ::close(fd); // ignore errors
+        throw;
+    }
+    fd_close(stdin_pipe[0]);
+    fd_close(stdout_pipe[1]);
+    if (error_pipe[1] >= 0)
+        fd_close(error_pipe[1]);
+    process->stdin_fd = stdin_pipe[1];
+    process->stdout_fd = stdout_pipe[0];
+    process->error_fd = error_pipe[0];
+    this->process = std::move(process);
+}
+
+void RecordFilter::fail()
+// The command terminated prematurely; throw an exception.
+{
+    std::unique_ptr<Process> process(std::move(this->process));
+    process->close_pipes();
+    ChildProcess child = process->child;
+    int error_fd = process->error_fd;
+    process->child.pid = -1;
+    process->error_fd = -1;
+    wait_child(child, error_fd, this->command_line);
+    std::string message = string_printf(
+        _("External command \"%s\" terminated before producing complete output"),
+        this->command_line.c_str()
+    );
+    throw Command::CommandFailed(message);
+}
+
+std::string RecordFilter::operator()(const std::string &record)
+{
+    if (this->process == nullptr)
+        this->start();
+    Process &process = *this->process;
+    const std::string input = record + '\0';
+    size_t written = 0;
+    size_t scanned = 0;
+    std::vector<char> buffer(1 << 16);
+    while (1) {
+        size_t end = process.output.find('\0', scanned);
+        if (end == std::string::npos)
+            scanned = process.output.size();
+        else if (written == input.size()) {
+            std::string result = process.output.substr(0, end);
+            process.output.erase(0, end + 1);
+            return result;
+        }
+        // Keep writing while reading, so that neither of the pipes
+        // can fill up and block the command:
+        struct pollfd fds[2];
+        fds[0].fd = written < input.size() ? process.stdin_fd : -1;
+        fds[0].events = POLLOUT;
+        fds[1].fd = process.stdout_fd;
+        fds[1].events = POLLIN;
+        int rc = poll(fds, 2, -1);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            int errno_copy = errno;
+            this->process.reset(); // the records would be out of sync
+            errno = errno_copy;
+            throw_posix_error("poll()");
+        }
+        if (fds[0].revents) {
+            ssize_t nbytes = write_nosigpipe(process.stdin_fd, input.data() + written, input.size() - written);
+            if (nbytes < 0 && errno == EPIPE)
+                this->fail();
+            if (nbytes < 0 && errno != EAGAIN && errno != EINTR) {
+                int errno_copy = errno;
+                this->process.reset(); // the records would be out of sync
+                errno = errno_copy;
+                throw_posix_error("write()");
+            }
+            if (nbytes > 0)
+                written += nbytes;
+        }
+        if (fds[1].revents) {
+            ssize_t nbytes = read(process.stdout_fd, buffer.data(), buffer.size());
+            if (nbytes < 0 && errno != EINTR) {
+                int errno_copy = errno;
+                this->process.reset(); // the records would be out of sync
+                errno = errno_copy;
+                throw_posix_error("read()");
+            }
+            if (nbytes == 0)
+                this->fail();
+            if (nbytes > 0)
+                process.output.append(buffer.data(), nbytes);
+        }
+    }
+}
+
 #endif
 
 // vim:ts=4 sts=4 sw=4 et
@@ -18,7 +18,12 @@
 #include "system.hh"
 
 #include <cassert>
+#include <cerrno>
+#include <memory>
 #include <sstream>
+#include <streambuf>
+#include <utility>
+#include <vector>
 
 #include <windows.h>
 
@@ -121,21 +126,57 @@ std::string Command::repr()
     );
 }
 
+class FilterWriterData
+{
+public:
+    HANDLE handle;
+    const std::string &string;
+    FilterWriterData(HANDLE handle, const std::string &string)
+    : handle(handle),
+      string(string)
+    { }
+};
+
+unsigned long WINAPI filter_writer(void *data_)
+{
+    bool success;
+    FilterWriterData *data = reinterpret_cast<FilterWriterData*>(data_);
+    success = WriteFile(data->handle, data->string.c_str(), data->string.length(), nullptr, nullptr);
+    if (!success)
+        throw_win32_error("WriteFile");
+    success = CloseHandle(data->handle);
+    if (!success)
+        throw_win32_error("CloseHandle");
+    return 0;
+}
+
 void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
 {
-    assert(stdin_ == nullptr); // stdin support not implemented yet
     int status = 0;
     unsigned long rc;
     PROCESS_INFORMATION process_info;
     HANDLE read_end, write_end, error_handle;
+    HANDLE stdin_read = nullptr, stdin_write = nullptr;
     SECURITY_ATTRIBUTES security_attributes;
+    std::string stdin_data;
     memset(&process_info, 0, sizeof process_info);
     security_attributes.nLength = sizeof (SECURITY_ATTRIBUTES);
     security_attributes.lpSecurityDescriptor = nullptr;
     security_attributes.bInheritHandle = true;
     if (CreatePipe(&read_end, &write_end, &security_attributes, 0) == 0)
         throw_win32_error("CreatePipe");
+    if (stdin_ != nullptr) {
+        // Anonymous pipes don't support overlapped I/O,
+        // so the input is buffered and fed from a separate thread.
+        std::ostringstream stream;
+        stream << stdin_->rdbuf();
+        stdin_data = stream.str();
+        if (CreatePipe(&stdin_read, &stdin_write, &security_attributes, 0) == 0)
+            throw_win32_error("CreatePipe");
+    }
     rc = SetHandleInformation(read_end, HANDLE_FLAG_INHERIT, 0);
+    if (rc != 0 && stdin_ != nullptr)
+        rc = SetHandleInformation(stdin_write, HANDLE_FLAG_INHERIT, 0);
     if (rc == 0) {
         if (GetLastError() == ERROR_CALL_NOT_IMPLEMENTED) {
             // Presumably it's Windows 9x, so the call is not supported.
@@ -167,6 +208,8 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
         STARTUPINFO startup_info;
         memset(&startup_info, 0, sizeof startup_info);
         startup_info.cb = sizeof startup_info;
+        if (stdin_ != nullptr)
+            startup_info.hStdInput = stdin_read;
         startup_info.hStdOutput = write_end;
         startup_info.hStdError = error_handle;
         startup_info.dwFlags = STARTF_USESTDHANDLES;
@@ -191,7 +234,15 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
     }
     if (status == 0) {
         unsigned long exit_code;
+        HANDLE thread_handle = nullptr;
         CloseHandle(write_end); // ignore errors
+        FilterWriterData writer_data(stdin_write, stdin_data);
+        if (stdin_ != nullptr) {
+            CloseHandle(stdin_read); // ignore errors
+            thread_handle = CreateThread(nullptr, 0, filter_writer, &writer_data, 0, nullptr);
+            if (thread_handle == nullptr)
+                throw_win32_error("CreateThread");
+        }
         while (true) {
             char buffer[BUFSIZ];
             unsigned long nbytes;
@@ -204,6 +255,12 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
                 stdout_->write(buffer, nbytes);
         }
         CloseHandle(read_end); // ignore errors
+        if (thread_handle != nullptr) {
+            rc = WaitForSingleObject(thread_handle, INFINITE);
+            if (rc == WAIT_FAILED)
+                throw_win32_error("WaitForSingleObject");
+            CloseHandle(thread_handle); // ignore errors
+        }
         rc = WaitForSingleObject(process_info.hProcess, INFINITE);
         if (rc == WAIT_FAILED)
             throw_win32_error("WaitForSingleObject");
@@ -230,28 +287,257 @@ void Command::call(std::istream *stdin_, std::ostream *stdout_, bool stderr_)
     }
 }
 
-class FilterWriterData
+class PipeBuffer : public std::streambuf
+// Output stream buffer that writes to a pipe.
+// If the reading end is closed, the data are silently discarded;
+// the caller is expected to check is_broken() afterwards.
 {
-public:
+protected:
     HANDLE handle;
-    const std::string &string;
-    FilterWriterData(HANDLE handle, const std::string &string)
+    bool broken;
+    std::vector<char> buffer;
+    void flush()
+    {
+        const char *data = this->pbase();
+        unsigned long size = this->pptr() - this->pbase();
+        while (size > 0 && !this->broken) {
+            unsigned long nbytes;
+            bool success = WriteFile(this->handle, data, size, &nbytes, nullptr);
+            if (!success) {
+                unsigned long error = GetLastError();
+                if (error == ERROR_BROKEN_PIPE || error == ERROR_NO_DATA) {
+                    this->broken = true;
+                    break;
+                }
+                throw_win32_error("WriteFile");
+            }
+            data += nbytes;
+            size -= nbytes;
+        }
+        this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+    }
+    virtual int_type overflow(int_type c)
+    {
+        this->flush();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *this->pptr() = traits_type::to_char_type(c);
+            this->pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    virtual int sync()
+    {
+        this->flush();
+        return 0;
+    }
+public:
+    explicit PipeBuffer(HANDLE handle)
     : handle(handle),
-      string(string)
-    { }
+      broken(false),
+      buffer(1 << 16)
+    {
+        this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+    }
+    void close()
+    {
+        if (this->handle == nullptr)
+            return;
+        this->flush();
+        HANDLE handle = this->handle;
+        this->handle = nullptr;
+        if (CloseHandle(handle) == 0)
+            throw_win32_error("CloseHandle");
+    }
+    bool is_broken() const
+    {
+        return this->broken;
+    }
+    ~PipeBuffer()
+    {
+        if (this->handle != nullptr)
+            CloseHandle(this->handle); // ignore errors
+    }
 };
 
-unsigned long WINAPI filter_writer(void *data_)
+class Command::Child
 {
-    bool success;
-    FilterWriterData *data = reinterpret_cast<FilterWriterData*>(data_);
-    success = WriteFile(data->handle, data->string.c_str(), data->string.length(), nullptr, nullptr);
-    if (!success)
-        throw_win32_error("WriteFile");
-    success = CloseHandle(data->handle);
-    if (!success)
-        throw_win32_error("CloseHandle");
-    return 0;
+public:
+    PROCESS_INFORMATION process_info;
+    PipeBuffer stdin_buffer;
+    std::ostream stdin_;
+    Child(const PROCESS_INFORMATION &process_info, HANDLE stdin_handle)
+    : process_info(process_info),
+      stdin_buffer(stdin_handle),
+      stdin_(&stdin_buffer)
+    {
+        this->stdin_.exceptions(std::ios::badbit);
+    }
+    ~Child()
+    {
+        if (this->process_info.hProcess == nullptr)
+            return;
+        // Something went wrong before wait() was called.
+        // Let the child see EOF, and then reap it.
+        try {
+            this->stdin_buffer.close();
+        } catch (const OSError &) {
+            // ignore errors
+        }
+        WaitForSingleObject(this->process_info.hProcess, INFINITE); // ignore errors
+        CloseHandle(this->process_info.hProcess); // ignore errors
+        CloseHandle(this->process_info.hThread); // ignore errors
+    }
+};
+
+Command::~Command()
+{ }
+
+std::ostream &Command::spawn(bool quiet)
+{
+    assert(this->child == nullptr);
+    unsigned long rc;
+    PROCESS_INFORMATION process_info;
+    HANDLE stdin_read, stdin_write, null_handle, error_handle;
+    SECURITY_ATTRIBUTES security_attributes;
+    memset(&process_info, 0, sizeof process_info);
+    security_attributes.nLength = sizeof (SECURITY_ATTRIBUTES);
+    security_attributes.lpSecurityDescriptor = nullptr;
+    security_attributes.bInheritHandle = true;
+    if (CreatePipe(&stdin_read, &stdin_write, &security_attributes, 0) == 0)
+        throw_win32_error("CreatePipe");
+    rc = SetHandleInformation(stdin_write, HANDLE_FLAG_INHERIT, 0);
+    if (rc == 0) {
+        if (GetLastError() == ERROR_CALL_NOT_IMPLEMENTED) {
+            // Presumably it's Windows 9x, so the call is not supported.
+            // Punt on security and let the pipe end be inherited.
+        } else
+            throw_win32_error("SetHandleInformation");
+    }
+    null_handle = CreateFile("nul",
+        GENERIC_WRITE, FILE_SHARE_WRITE,
+        &security_attributes, OPEN_EXISTING, 0, nullptr);
+    // Errors can be safely ignored; see call() for details.
+    error_handle = null_handle;
+    if (!quiet) {
+        error_handle = GetStdHandle(STD_ERROR_HANDLE);
+        if (error_handle != INVALID_HANDLE_VALUE) {
+            rc = DuplicateHandle(
+                GetCurrentProcess(), error_handle,
+                GetCurrentProcess(), &error_handle,
+                0, true, DUPLICATE_SAME_ACCESS
+            );
+            if (rc == 0)
+                throw_win32_error("DuplicateHandle");
+        }
+    }
+    {
+        const std::string &command_line = argv_to_command_line(this->argv);
+        STARTUPINFO startup_info;
+        memset(&startup_info, 0, sizeof startup_info);
+        startup_info.cb = sizeof startup_info;
+        startup_info.hStdInput = stdin_read;
+        startup_info.hStdOutput = null_handle;
+        startup_info.hStdError = error_handle;
+        startup_info.dwFlags = STARTF_USESTDHANDLES;
+        char *c_command_line = strdup(command_line.c_str());
+        if (c_command_line == nullptr)
+            throw_posix_error("strdup");
+        rc = CreateProcess(
+            nullptr, c_command_line,
+            nullptr, nullptr,
+            true, 0,
+            nullptr, nullptr,
+            &startup_info,
+            &process_info
+        );
+        free(c_command_line);
+    }
+    CloseHandle(stdin_read); // ignore errors
+    if (null_handle != INVALID_HANDLE_VALUE)
+        CloseHandle(null_handle); // ignore errors
+    if (error_handle != null_handle && error_handle != INVALID_HANDLE_VALUE)
+        CloseHandle(error_handle); // ignore errors
+    if (rc == 0) {
+        CloseHandle(stdin_write); // ignore errors
+        std::string message = string_printf(
+            _("External command \"%s\" failed"),
+            this->repr().c_str()
+        );
+        throw_win32_error(message);
+    }
+    this->child.reset(new Child(process_info, stdin_write));
+    return this->child->stdin_;
+}
+
+void Command::wait()
+{
+    assert(this->child != nullptr);
+    std::unique_ptr<Child> child(std::move(this->child));
+    child->stdin_buffer.close();
+    PROCESS_INFORMATION process_info = child->process_info;
+    child->process_info.hProcess = nullptr;
+    unsigned long exit_code;
+    unsigned long rc = WaitForSingleObject(process_info.hProcess, INFINITE);
+    if (rc != WAIT_FAILED)
+        rc = GetExitCodeProcess(process_info.hProcess, &exit_code);
+    else
+        rc = 0;
+    CloseHandle(process_info.hProcess); // ignore errors
+    CloseHandle(process_info.hThread); // ignore errors
+    if (rc == 0) {
+        std::string message = string_printf(
+            _("External command \"%s\" failed"),
+            this->repr().c_str()
+        );
+        throw_win32_error(message);
+    }
+    if (exit_code != 0) {
+        std::string message = string_printf(
+            _("External command \"%s\" failed with exit status %lu"),
+            this->repr().c_str(),
+            exit_code
+        );
+        throw CommandFailed(message);
+    }
+    if (child->stdin_buffer.is_broken()) {
+        // The child process terminated,
+        // even though it didn't receive the complete input.
+        errno = EPIPE;
+        throw_posix_error("WriteFile");
+    }
+}
+
+class RecordFilter::Process
+{ };
+
+RecordFilter::RecordFilter(const std::string &command_line)
+: command_line(command_line)
+{ }
+
+RecordFilter::~RecordFilter()
+{ }
+
+std::string RecordFilter::operator()(const std::string &record)
+// There's no poll() for pipes on Windows,
+// so every record is filtered by a separate process.
+{
+    std::string result = Command::filter(this->command_line, record + '\0');
+    size_t end = result.find('\0');
+    if (end == std::string::npos) {
+        std::string message = string_printf(
+            _("External command \"%s\" terminated before producing complete output"),
+            this->command_line.c_str()
+        );
+        throw Command::CommandFailed(message);
+    }
+    result.erase(end);
+    return result;
+}
+
+void Command::start_helper()
+{
+    // Process creation doesn't copy the address space on Windows;
+    // there's nothing to gain from a helper process.
 }
 
 std::string Command::filter(const std::string &command_line, const std::string &string)
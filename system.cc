@@ -17,6 +17,7 @@
 #include "system.hh"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
 #include <climits>
@@ -24,17 +25,27 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <vector>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#if HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 #if WIN32
-#include <fcntl.h>
 #include <windows.h>
 #endif
 
@@ -52,6 +63,14 @@ static const char path_separator = '\\';
 static const char path_separator = '/';
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
 
 /* class POSIXError : OSError
  * ==========================
@@ -419,8 +438,138 @@ std::ostream &operator<<(std::ostream &out, const File &file)
  * ==========================
  */
 
+#if HAVE_MEMFD_CREATE
+
+static std::atomic<size_t> memory_budget(0);
+
+/* Memory-backed files that are open or pooled, with their last known sizes.
+ * Guarded by memory_files_mutex.
+ */
+static std::map<int, size_t> memory_file_sizes;
+static std::mutex memory_files_mutex;
+
+class MemoryFilePool
+/* Truncated memory-backed files that can be reused by the current thread.
+ * They are closed when the thread exits.
+ */
+{
+public:
+  std::vector<int> fds;
+  ~MemoryFilePool()
+  {
+    std::lock_guard<std::mutex> lock(memory_files_mutex);
+    for (int fd : this->fds)
+    {
+      memory_file_sizes.erase(fd);
+      if (::close(fd) == -1)
+        warn_posix_error("close()");
+    }
+  }
+};
+
+static thread_local MemoryFilePool memory_file_pool;
+static const size_t memory_file_pool_size = 8;
+
+static size_t get_memory_usage()
+/* Return the total size of memory-backed files.
+ * Files can grow at any time (possibly in other threads or in external
+ * commands), so all of them are examined again.
+ * Must be called with memory_files_mutex locked.
+ */
+{
+  size_t usage = 0;
+  for (auto &item : memory_file_sizes)
+  {
+    struct stat st;
+    if (fstat(item.first, &st) == 0)
+      item.second = st.st_size;
+    usage += item.second;
+  }
+  return usage;
+}
+
+static int create_memory_file()
+/* Return a file descriptor of an empty memory-backed file,
+ * or -1 if the memory budget is exhausted.
+ */
+{
+  if (memory_budget == 0)
+    return -1;
+  int fd = -1;
+  if (!memory_file_pool.fds.empty())
+  {
+    fd = memory_file_pool.fds.back();
+    memory_file_pool.fds.pop_back();
+  }
+  bool within_budget;
+  int memfd_errno = 0;
+  {
+    std::lock_guard<std::mutex> lock(memory_files_mutex);
+    within_budget = get_memory_usage() < memory_budget;
+    if (within_budget && fd < 0)
+    {
+      fd = memfd_create(PACKAGE_NAME, MFD_CLOEXEC);
+      if (fd >= 0)
+        memory_file_sizes[fd] = 0;
+      else
+        memfd_errno = errno;
+    }
+  }
+  if (memfd_errno == ENOSYS)
+    /* Not supported by the kernel; don't try again. */
+    memory_budget = 0;
+  if (!within_budget && fd >= 0)
+  {
+    memory_file_pool.fds.push_back(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+static void release_memory_file(int fd)
+/* Truncate the file and keep it for reuse, or close it if the pool is full. */
+{
+  bool pooled = false;
+  if (memory_file_pool.fds.size() < memory_file_pool_size && ftruncate(fd, 0) == 0)
+  {
+    memory_file_pool.fds.push_back(fd);
+    pooled = true;
+  }
+  {
+    std::lock_guard<std::mutex> lock(memory_files_mutex);
+    if (pooled)
+      memory_file_sizes[fd] = 0;
+    else
+      memory_file_sizes.erase(fd);
+  }
+  if (!pooled && ::close(fd) == -1)
+    warn_posix_error("close()");
+}
+
+void TemporaryFile::set_memory_budget(size_t size)
+{
+  memory_budget = size;
+}
+
+#else
+
+void TemporaryFile::set_memory_budget(size_t)
+{ }
+
+#endif
+
 void TemporaryFile::construct()
 {
+#if HAVE_MEMFD_CREATE
+  this->memory_fd = create_memory_file();
+  if (this->memory_fd >= 0)
+  {
+    /* /proc/self would not work for external commands: */
+    std::string path = string_printf("/proc/%ld/fd/%d", static_cast<long>(getpid()), this->memory_fd);
+    this->open(path, File::trunc);
+    return;
+  }
+#endif
 #if !WIN32
   TemporaryPathTemplate path_buffer;
   int fd = mkstemp(path_buffer);
@@ -440,6 +589,7 @@ void TemporaryFile::construct()
 }
 
 TemporaryFile::TemporaryFile()
+: memory_fd(-1)
 {
   this->construct();
 }
@@ -448,6 +598,13 @@ TemporaryFile::~TemporaryFile()
 {
   if (this->is_open())
     this->close();
+#if HAVE_MEMFD_CREATE
+  if (this->memory_fd >= 0)
+  {
+    release_memory_file(this->memory_fd);
+    return;
+  }
+#endif
   if (unlink(this->name.c_str()) == -1)
     warn_posix_error(this->name);
 }
@@ -462,6 +619,202 @@ File::openmode ExistingFile::get_default_open_mode()
   return File::openmode();
 }
 
+
+/* class RawOutput
+ * ===============
+ */
+
+RawOutput::RawOutput(const std::string &path)
+: fd(-1), owned(true), name(path), base(0), offset(0)
+{
+  this->fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC, 0666);
+  if (this->fd < 0)
+    throw_posix_error(path);
+}
+
+RawOutput::RawOutput(const std::ostream &ostream)
+: fd(-1), owned(false), name(""), base(0), offset(0)
+{
+  if (&ostream != &std::cout)
+  {
+    /* not implemented */
+    throw std::invalid_argument("RawOutput(const std::ostream &)");
+  }
+  std::cout.flush();
+  this->fd = STDOUT_FILENO;
+  this->name = "stdout";
+  /* Standard output may be a file that already has some contents: */
+  off_t base = lseek(this->fd, 0, SEEK_CUR);
+  if (base != static_cast<off_t>(-1))
+    this->base = base;
+}
+
+RawOutput::~RawOutput()
+{
+  if (this->owned && this->fd >= 0 && ::close(this->fd) < 0)
+    warn_posix_error(this->name);
+}
+
+void RawOutput::close()
+{
+  if (!this->owned || this->fd < 0)
+    return;
+  int fd = this->fd;
+  this->fd = -1;
+  if (::close(fd) < 0)
+    throw_posix_error(this->name);
+}
+
+bool RawOutput::is_seekable() const
+/* Check if it's possible to go back and overwrite data that were already
+ * written.
+ */
+{
+  struct stat st;
+  if (fstat(this->fd, &st) < 0)
+    throw_posix_error(this->name);
+  if (!S_ISREG(st.st_mode))
+    return false;
+#if !WIN32
+  int flags = fcntl(this->fd, F_GETFL);
+  if (flags < 0)
+    throw_posix_error(this->name);
+  if (flags & O_APPEND)
+    return false;
+#endif
+  return true;
+}
+
+void RawOutput::seek(std::streamoff offset)
+{
+  if (lseek(this->fd, this->base + offset, SEEK_SET) == static_cast<off_t>(-1))
+    throw_posix_error(this->name);
+  this->offset = offset;
+}
+
+void RawOutput::write(const char *buffer, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t n = ::write(this->fd, buffer, size);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw_posix_error(this->name);
+    }
+    buffer += n;
+    size -= n;
+    this->offset += n;
+  }
+}
+
+static void copy_fd(int in_fd, const std::string &in_name, off_t offset, std::streamoff size,
+  int out_fd, const std::string &out_name)
+{
+  ssize_t n;
+#if HAVE_COPY_FILE_RANGE
+  /* Let the kernel copy the data, possibly sharing the extents. This works
+   * only if the output is a regular file on a suitable file system.
+   */
+  while (size > 0)
+  {
+    n = copy_file_range(in_fd, &offset, out_fd, nullptr, size, 0);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EXDEV || errno == EINVAL || errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP)
+        break;
+      throw_posix_error(out_name);
+    }
+    if (n == 0)
+    {
+      errno = EIO;
+      throw_posix_error(in_name);
+    }
+    size -= n;
+  }
+#endif
+#if HAVE_SENDFILE
+  /* sendfile() works also for pipes, which is the common case for standard
+   * output.
+   */
+  while (size > 0)
+  {
+    n = sendfile(out_fd, in_fd, &offset, size);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EINVAL || errno == ENOSYS)
+        break;
+      throw_posix_error(out_name);
+    }
+    if (n == 0)
+    {
+      errno = EIO;
+      throw_posix_error(in_name);
+    }
+    size -= n;
+  }
+#endif
+  if (size == 0)
+    return;
+  if (lseek(in_fd, offset, SEEK_SET) == static_cast<off_t>(-1))
+    throw_posix_error(in_name);
+  std::vector<char> buffer(1 << 16);
+  while (size > 0)
+  {
+    n = read(in_fd, buffer.data(), std::min(static_cast<std::streamoff>(buffer.size()), size));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw_posix_error(in_name);
+    }
+    if (n == 0)
+    {
+      errno = EIO;
+      throw_posix_error(in_name);
+    }
+    size -= n;
+    for (const char *p = buffer.data(); n > 0; )
+    {
+      ssize_t m = ::write(out_fd, p, n);
+      if (m < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        throw_posix_error(out_name);
+      }
+      p += m;
+      n -= m;
+    }
+  }
+}
+
+void RawOutput::copy(const File &file, std::streamoff offset, std::streamoff size)
+/* Append ``size`` bytes of the file, starting at ``offset``. */
+{
+  const std::string &path = file;
+  int in_fd = ::open(path.c_str(), O_RDONLY | O_BINARY | O_CLOEXEC);
+  if (in_fd < 0)
+    throw_posix_error(path);
+  try
+  {
+    copy_fd(in_fd, path, offset, size, this->fd, this->name);
+  }
+  catch (...)
+  {
+    ::close(in_fd);
+    throw;
+  }
+  if (::close(in_fd) < 0)
+    throw_posix_error(path);
+  this->offset += size;
+}
+
 #if WIN32
 
 /* class ProgramDir
@@ -18,6 +18,7 @@
 #include <cstddef>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -69,6 +70,8 @@ class Command
 protected:
   std::string command;
   std::vector<std::string> argv;
+  class Child;
+  std::unique_ptr<Child> child;
   std::string repr();
   void call(std::istream *stdin_, std::ostream *stdout_, bool stderr_);
 public:
@@ -80,6 +83,7 @@ public:
     { }
   };
   explicit Command(const std::string& command);
+  ~Command();
   Command &operator <<(const std::string& arg);
   Command &operator <<(const File& arg);
   Command &operator <<(int i);
@@ -87,11 +91,49 @@ public:
   {
     this->call(nullptr, &stdout_, !quiet);
   }
+  void operator()(std::istream &stdin_, std::ostream &stdout_, bool quiet=false)
+  {
+    this->call(&stdin_, &stdout_, !quiet);
+  }
   void operator()(bool quiet=false)
   {
     this->call(nullptr, nullptr, !quiet);
   }
+  /* Start the command, and return a stream connected to its standard input.
+   * The standard output is discarded.
+   * wait() must be called once all the input has been written.
+   */
+  std::ostream &spawn(bool quiet=false);
+  void wait();
   static std::string filter(const std::string &command_line, const std::string &string);
+  /* Start a helper process that will run all the subsequent commands.
+   * This should be called early, while the process is still small and
+   * single-threaded. It is a no-op on Windows.
+   */
+  static void start_helper();
+};
+
+class RecordFilter
+/* Long-running filter command for NUL-terminated records.
+ * Every record written to the standard input of the command must result
+ * in exactly one NUL-terminated record on its standard output.
+ * The command is started on first use, and stopped by the destructor.
+ * On Windows, the command is started anew for every record.
+ */
+{
+private:
+  RecordFilter(const RecordFilter&) = delete;
+  RecordFilter& operator=(const RecordFilter&) = delete;
+protected:
+  std::string command_line;
+  class Process;
+  std::unique_ptr<Process> process;
+  void start();
+  void fail();
+public:
+  explicit RecordFilter(const std::string &command_line);
+  ~RecordFilter();
+  std::string operator()(const std::string &record);
 };
 
 class Directory
@@ -150,16 +192,24 @@ private:
   TemporaryFile(const TemporaryFile &) = delete;
   TemporaryFile& operator=(const TemporaryFile &) = delete;
 protected:
+  int memory_fd;
   void construct();
 public:
   TemporaryFile(const Directory& directory, const std::string &name)
-  : File(directory, name)
+  : File(directory, name),
+    memory_fd(-1)
   { }
   explicit TemporaryFile(const std::string &name)
-  : File(name)
+  : File(name),
+    memory_fd(-1)
   { }
   TemporaryFile();
   virtual ~TemporaryFile();
+  /* Keep anonymous temporary files in memory, as long as their total size
+   * doesn't exceed the budget. External commands access such files through
+   * /proc. The default budget is 0, i.e. all temporary files are on disk.
+   */
+  static void set_memory_budget(size_t size);
 };
 
 class ExistingFile : public File
@@ -180,6 +230,40 @@ public:
   { }
 };
 
+class RawOutput
+/* Unbuffered output to a file descriptor.
+ * Unlike File, it can be attached to standard output, and it can copy data
+ * from other files without passing them through user space.
+ */
+{
+private:
+  RawOutput(const RawOutput &) = delete;
+  RawOutput& operator=(const RawOutput &) = delete;
+protected:
+  int fd;
+  bool owned;
+  std::string name;
+  std::streamoff base;
+  std::streamoff offset;
+public:
+  explicit RawOutput(const std::string &path);
+  explicit RawOutput(const std::ostream &ostream);
+  virtual ~RawOutput();
+  void write(const char *buffer, size_t size);
+  void write(const std::string &data)
+  {
+    this->write(data.data(), data.size());
+  }
+  void copy(const File &file, std::streamoff offset, std::streamoff size);
+  std::streamoff tell() const
+  {
+    return this->offset;
+  }
+  bool is_seekable() const;
+  void seek(std::streamoff offset);
+  void close();
+};
+
 #if WIN32
 
 class ProgramDir
@@ -0,0 +1,102 @@
+# encoding=UTF-8
+
+# Copyright © 2026 agent <agent@local>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+
+import re
+import sys
+
+from tools import (
+    SkipTest,
+    assert_equal,
+    assert_greater,
+    assert_not_equal,
+    case,
+)
+
+# Print the command names of the parent and the grandparent of the shell:
+ancestry_filter = 'ppid=$(ps -o ppid= -p $PPID); echo $(ps -o comm= -p $PPID) $(ps -o comm= -p $ppid) >&2; cat'
+
+# Print the number of memory-backed files that the parent has open:
+memfd_filter = 'ls -l /proc/$PPID/fd | grep -c memfd: >&2; cat'
+
+class test(case):
+
+    def check_output(self):
+        r = self.ls()
+        r.assert_(stdout=re.compile(
+            r'\n'
+            r'\s*1\s+P\s+\d+\s+p0001[.]djvu\s+T=1\n'
+            r'\s*2\s+P\s+\d+\s+p0002[.]djvu\s+T=2\n'
+            r'\s*3\s+P\s+\d+\s+p0003[.]djvu\s+T=3\n'
+        ))
+        r = self.print_text()
+        r.assert_(stdout=re.compile('^Lorem *\n.*ipsum *\n.*dolor *\n', re.DOTALL))
+
+    def test_encoder_batch(self):
+        self.pdf2djvu('--encoder-batch=2').assert_()
+        self.check_output()
+
+    def test_encoder_batch_invalid(self):
+        r = self.pdf2djvu('--encoder-batch=0')
+        r.assert_(stderr=re.compile('^The specified number of pages per encoder run must be positive\n'), rc=1)
+
+    def test_encode_jobs(self):
+        self.pdf2djvu('--render-jobs=2', '--encode-jobs=1').assert_()
+        self.check_output()
+
+    def test_encode_jobs_batch(self):
+        self.pdf2djvu('--render-jobs=1', '--encode-jobs=2', '--encoder-batch=2').assert_()
+        self.check_output()
+
+    def test_encode_jobs_invalid(self):
+        r = self.pdf2djvu('--encode-jobs=-1')
+        r.assert_(stderr=re.compile('^The specified number of encoding threads must not be negative\n'), rc=1)
+        r = self.pdf2djvu('--render-jobs=-1')
+        r.assert_(stderr=re.compile('^The specified number of rendering threads must not be negative\n'), rc=1)
+
+    def get_ancestry(self, *args):
+        self.require_feature('POSIX')
+        r = self.pdf2djvu('--filter-text', ancestry_filter, *args)
+        r.assert_(stderr=re.compile(r'\A(\S+ \S+\n){3}\Z'))
+        self.check_output()
+        return [line.split() for line in r.stderr.splitlines()]
+
+    def test_spawn_helper(self):
+        # Without the helper, the tools are started by pdf2djvu itself:
+        for parent, grandparent in self.get_ancestry():
+            assert_not_equal(parent, grandparent)
+        # With the helper, they are started by a runner forked from the helper,
+        # which was in turn forked from pdf2djvu:
+        for parent, grandparent in self.get_ancestry('--spawn-helper'):
+            assert_equal(parent, grandparent)
+
+    def test_spawn_helper_failure(self):
+        self.require_feature('POSIX')
+        r = self.pdf2djvu('--spawn-helper', '--filter-text=false')
+        r.assert_(stderr=re.compile('External command "false" failed with exit status 1\n'), rc=1)
+
+    def get_memfd_counts(self, *args):
+        if not sys.platform.startswith('linux'):
+            raise SkipTest('Linux is required')
+        r = self.pdf2djvu('--filter-text', memfd_filter, *args)
+        r.assert_(stderr=re.compile(r'\A(\d+\n){3}\Z'))
+        self.check_output()
+        return [int(line) for line in r.stderr.splitlines()]
+
+    def test_temporary_memory(self):
+        assert_equal(self.get_memfd_counts(), [0, 0, 0])
+        for count in self.get_memfd_counts('--temporary-memory=1'):
+            assert_greater(count, 0)
+
+# vim:ts=4 sts=4 sw=4 et
@@ -0,0 +1,40 @@
+# encoding=UTF-8
+
+# Copyright © 2026 agent <agent@local>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+
+from tools import (
+    assert_equal,
+    assert_in,
+    case,
+    count_colors,
+)
+
+class test(case):
+
+    def test(self):
+        # The page has 4913 foreground colors, more than the palette can hold.
+        # They are reduced with increasing divisors until they fit;
+        # divisor 13 leaves 15 levels per component:
+        self.pdf2djvu('--dpi=72').assert_()
+        image = self.decode(mode='foreground')
+        colors = count_colors(image)
+        assert_in('\xFF\xFF\xFF', colors)
+        assert_equal(len(colors), 15 ** 3 + 1)
+        levels = set()
+        for color in colors:
+            if color != '\xFF\xFF\xFF':
+                levels.update(bytearray(color))
+        assert_equal(sorted(levels), [12, 24, 40, 65, 81, 93, 105, 134, 146, 162, 174, 186, 215, 231, 243])
+
+# vim:ts=4 sts=4 sw=4 et
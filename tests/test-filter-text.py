@@ -26,4 +26,10 @@ class test(case):
         r = self.print_text()
         r.assert_(stdout=re.compile('^Yberz vcfhz *\n'))
 
+    def test_persistent_rot13(self):
+        self.require_feature('POSIX')
+        self.pdf2djvu('--persistent-filter-text', 'perl -0 -pe "BEGIN { \\$| = 1 } tr/a-zA-Z/n-za-mN-ZA-M/"').assert_()
+        r = self.print_text()
+        r.assert_(stdout=re.compile('^Yberz vcfhz *\n'))
+
 # vim:ts=4 sts=4 sw=4 et
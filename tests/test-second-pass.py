@@ -0,0 +1,38 @@
+# encoding=UTF-8
+
+# Copyright © 2026 agent <agent@local>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+
+import re
+
+from tools import (
+    assert_equal,
+    assert_true,
+    case,
+)
+
+class test(case):
+
+    def test(self):
+        # Neither of the pages needs to be rendered twice:
+        r = self.pdf2djvu('-vv', quiet=False)
+        r.assert_(stderr=re.compile('compositing text onto the foreground image'))
+        assert_equal(r.stderr.count('rendering page (1st pass)'), 2)
+        assert_true('2nd pass' not in r.stderr)
+        assert_equal(r.stderr.count('compositing text onto the foreground image'), 1)
+        r = self.djvudump()
+        r.assert_(stdout=re.compile(r'\bSjbz\b'))
+        r = self.print_text()
+        r.assert_(stdout=re.compile('^Lorem *\n.*ipsum *\n', re.DOTALL))
+
+# vim:ts=4 sts=4 sw=4 et
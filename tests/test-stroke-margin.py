@@ -0,0 +1,37 @@
+# encoding=UTF-8
+
+# Copyright © 2026 agent <agent@local>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+
+from tools import (
+    assert_equal,
+    assert_greater,
+    case,
+)
+
+class test(case):
+
+    def get_mask(self, page):
+        image = self.decode(mode='mask', fmt='pgm', page=page)
+        return [line.tobytes() for line in image]
+
+    def test(self):
+        # Only the area around the stroke is compared on the 1st page,
+        # whereas the whole page is compared on the 2nd one.
+        # The stroke must not extend beyond that area.
+        self.pdf2djvu('--dpi=72').assert_()
+        mask = self.get_mask(1)
+        assert_greater(sum(line.count('\0') for line in mask), 1000)
+        assert_equal(mask, self.get_mask(2))
+
+# vim:ts=4 sts=4 sw=4 et
@@ -16,6 +16,7 @@
 import re
 
 from tools import (
+    assert_true,
     case,
 )
 
@@ -37,4 +38,29 @@ class test(case):
         r = self.djvudump()
         r.assert_(stdout=re.compile('BG44.* 9x9$', re.M))
 
+    def get_background_color(self):
+        image = self.decode(mode='background')
+        n = 0
+        sums = [0, 0, 0]
+        for line in image:
+            for pixel in line:
+                for i, c in enumerate(bytearray(pixel)):
+                    sums[i] += c
+                n += 1
+        return [s / n for s in sums]
+
+    def test_downsample(self):
+        self.pdf2djvu('--bg-subsample=11', '--dpi=72').assert_()
+        rendered_color = self.get_background_color()
+        r = self.pdf2djvu('--bg-subsample=11', '--bg-downsample', '--dpi=72', '-vv', quiet=False)
+        r.assert_(stderr=re.compile('downsampling background image'))
+        assert_true('rendering background image' not in r.stderr)
+        r = self.djvudump()
+        r.assert_(stdout=re.compile('BG44.* 10x11$', re.M))
+        # Averaging the full-resolution bitmap should give about the same
+        # image as rendering it at the lower resolution:
+        downsampled_color = self.get_background_color()
+        for rendered, downsampled in zip(rendered_color, downsampled_color):
+            assert_true(abs(rendered - downsampled) <= 8)
+
 # vim:ts=4 sts=4 sw=4 et
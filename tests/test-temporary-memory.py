@@ -0,0 +1,56 @@
+# encoding=UTF-8
+
+# Copyright © 2026 agent <agent@local>
+#
+# This file is part of pdf2djvu.
+#
+# pdf2djvu is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# pdf2djvu is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+
+import os
+import re
+import sys
+
+from tools import (
+    SkipTest,
+    assert_greater,
+    case,
+)
+
+# Print the number of memory-backed files that the parent has open:
+memfd_filter = 'ls -l /proc/$PPID/fd | grep -c memfd: >&2; cat'
+
+class test(case):
+
+    def get_memfd_counts(self, *args):
+        if not sys.platform.startswith('linux'):
+            raise SkipTest('Linux is required')
+        r = self.pdf2djvu(
+            '--filter-text', memfd_filter,
+            '--dpi=72', '--bg-subsample=1', '--bg-slices=100',
+            *args
+        )
+        r.assert_(stderr=re.compile(r'\A(\d+\n){8}\Z'))
+        counts = [int(line) for line in r.stderr.splitlines()]
+        r = self.ls()
+        r.assert_(stdout=re.compile(r'\n\s*8\s+P\s+\d+\s+p0008[.]djvu\s+T=8\n'))
+        return counts
+
+    def test(self):
+        # Without a tight budget, components of all the pages are kept in memory:
+        unlimited = self.get_memfd_counts('--temporary-memory=1000')
+        budget = 1 << 20
+        # Every page takes more space than the budget:
+        assert_greater(os.path.getsize(self.get_djvu_path()), 8 * budget)
+        # With the budget, only the first few files are kept in memory;
+        # later ones are created on disk:
+        limited = self.get_memfd_counts('--temporary-memory=1')
+        assert_greater(unlimited[-1] - 3, limited[-1])
+
+# vim:ts=4 sts=4 sw=4 et
@@ -0,0 +1,103 @@
+/* Copyright © 2026 agent <agent@local>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "thread-pool.hh"
+
+#include <cassert>
+
+#if _OPENMP
+#include <omp.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+static int pool_size = 1;
+
+void ThreadPool::run(int n_threads, const ThreadPool::Function &function)
+{
+  assert(n_threads > 0);
+  assert(pool_size == 1);
+  pool_size = n_threads;
+#if _OPENMP
+  #pragma omp parallel num_threads(n_threads)
+  function(omp_get_thread_num(), omp_get_num_threads());
+#else
+  std::vector<std::thread> threads;
+  threads.reserve(n_threads - 1);
+  /* The size of the team is known only once all the threads are started,
+   * so they wait for it before calling the function: */
+  std::mutex mutex;
+  std::condition_variable ready;
+  int n_started = 0;
+  auto thread_main = [&](int thread)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready.wait(lock, [&] { return n_started > 0; });
+    }
+    function(thread, n_started);
+  };
+  try
+  {
+    for (int i = 1; i < n_threads; i++)
+      threads.push_back(std::thread(thread_main, i));
+  }
+  catch (...)
+  {
+    /* Carry on with the threads that could be started. */
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    n_started = threads.size() + 1;
+    pool_size = n_started;
+  }
+  ready.notify_all();
+  try
+  {
+    function(0, n_started);
+  }
+  catch (...)
+  {
+    /* Destroying a joinable thread would terminate the program: */
+    for (std::thread &thread : threads)
+      thread.join();
+    pool_size = 1;
+    throw;
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+#endif
+  pool_size = 1;
+}
+
+int ThreadPool::get_default_size()
+{
+#if _OPENMP
+  return omp_get_max_threads();
+#else
+  unsigned int n = std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+#endif
+}
+
+int ThreadPool::get_size()
+/* Return the number of threads in the running team, or 1 if there's none. */
+{
+  return pool_size;
+}
+
+// vim:ts=2 sts=2 sw=2 et
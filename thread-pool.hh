@@ -0,0 +1,38 @@
+/* Copyright © 2026 agent <agent@local>
+ *
+ * This file is part of pdf2djvu.
+ *
+ * pdf2djvu is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * pdf2djvu is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PDF2DJVU_THREAD_POOL_HH
+#define PDF2DJVU_THREAD_POOL_HH
+
+#include <functional>
+
+class ThreadPool
+/* A team of threads running the same function.
+ *
+ * OpenMP is used if available; otherwise, the threads are started with
+ * std::thread.
+ */
+{
+public:
+  /* The function is called with the thread number and the number of threads
+   * that were actually started, which can be smaller than requested: */
+  typedef std::function<void (int thread, int n_threads)> Function;
+  static void run(int n_threads, const Function &function);
+  static int get_default_size();
+  static int get_size();
+};
+
+#endif
+
+// vim:ts=2 sts=2 sw=2 et